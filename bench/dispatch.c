@@ -0,0 +1,79 @@
+/*
+Builtin dispatch microbenchmark.
+
+  cc -O2 -o dispatch bench/dispatch.c && ./dispatch
+
+Times find_builtin() from libwish.c against the linear strcmp scan it replaced,
+over the real builtin table padded with made-up names to 2x, 4x and 8x its size.
+The scan grows with every builtin added; the perfect hash is one hash, one jump
+and at most one strcmp whatever the size of the table.
+*/
+#include "../libwish.c"
+
+#define ROUNDS 2000000
+#define MAX_TABLE 128
+
+// What batch lines typically start with, builtins and programs mixed
+static const char *workload[] = {"echo", "ls", "grep", "true", "cat", "printf", "awk", "test",
+                                 "sed", "cd", "wc", "sort", "[", "sleep", "make", "pwd"};
+#define WORKLOAD (sizeof(workload) / sizeof(workload[0]))
+
+static const char *table[MAX_TABLE];
+static volatile size_t sink; // Keeps the lookups from being optimized away
+
+// Function to get CLOCK_MONOTONIC in nanoseconds
+static double now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+/*
+name: command to look up
+size: entries of table[] in use
+Returns the index, or size if it isn't there
+*/
+static size_t linear_find(const char *name, size_t size)
+{
+  size_t i;
+  for (i = 0; i < size; i++)
+  {
+    if (strcmp(name, table[i]) == 0)
+      break;
+  }
+  return i;
+}
+
+int main(void)
+{
+  size_t builtin_count = sizeof(builtins) / sizeof(builtins[0]);
+  size_t i, round;
+  static char padding[MAX_TABLE][16];
+  for (i = 0; i < MAX_TABLE; i++)
+  {
+    if (i < builtin_count)
+    {
+      table[i] = builtins[i].name;
+    }
+    else
+    {
+      snprintf(padding[i], sizeof(padding[i]), "builtin%zu", i);
+      table[i] = padding[i];
+    }
+  }
+  printf("entries\tlinear_ns\thash_ns\n");
+  size_t size;
+  for (size = builtin_count; size <= MAX_TABLE && size <= builtin_count * 8; size *= 2)
+  {
+    double started = now_ns();
+    for (round = 0; round < ROUNDS; round++)
+      sink += linear_find(workload[round % WORKLOAD], size);
+    double linear = (now_ns() - started) / ROUNDS;
+    started = now_ns();
+    for (round = 0; round < ROUNDS; round++)
+      sink += (size_t)find_builtin(workload[round % WORKLOAD]);
+    double hashed = (now_ns() - started) / ROUNDS;
+    printf("%zu\t%.1f\t%.1f\n", size, linear, hashed);
+  }
+  return 0;
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define STAMP_FD 3       // Where bench/stamp writes, see stamp.c
+#define SAMPLE_MS 1      // How often the shell's VmHWM is read while it runs
+#define MAX_STAMPS 1000000
+
+char error_message[30] = "An error has occurred\n";
+
+static long long stamps[MAX_STAMPS];
+static size_t stamp_count;
+
+// Function to read the shell's peak RSS, 0 once it has exited
+long read_hwm(pid_t pid)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/proc/%d/status", (int)pid);
+  FILE *status = fopen(name, "r");
+  if (status == NULL)
+    return 0;
+  char line[256];
+  long kb = 0;
+  while (fgets(line, sizeof(line), status) != NULL)
+  {
+    if (strncmp(line, "VmHWM:", 6) == 0)
+    {
+      kb = atol(line + 6);
+      break;
+    }
+  }
+  fclose(status);
+  return kb;
+}
+/*
+buffer: bytes read from the stamp pipe
+len: how many
+partial: a line cut at the end of the previous read, kept across calls
+*/
+void parse_stamps(const char *buffer, size_t len, char *partial, size_t *partial_len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+  {
+    if (buffer[i] != '\n')
+    {
+      if (*partial_len < 31)
+        partial[(*partial_len)++] = buffer[i];
+      continue;
+    }
+    partial[*partial_len] = '\0';
+    if (stamp_count < MAX_STAMPS)
+      stamps[stamp_count++] = atoll(partial);
+    *partial_len = 0;
+  }
+}
+// Function to order stamps for qsort
+int compare_stamps(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+/*
+sorted: gaps between consecutive stamps
+count: number of gaps
+p: percentile, 0-100
+*/
+double percentile_us(long long sorted[], size_t count, double p)
+{
+  if (count == 0)
+    return 0;
+  size_t index = (size_t)(p / 100 * (count - 1) + 0.5);
+  return sorted[index] / 1000.0;
+}
+/*
+Runs one shell over one workload and prints a single TSV row:
+commands, seconds, commands/s, p50/p90/p99/max gap between command starts in
+microseconds, peak RSS of the shell in kB
+usage: driver [-i stdin-file] shell [args...]
+*/
+int main(int argc, char *argv[])
+{
+  const char *input = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "+i:")) != -1)
+  {
+    if (opt == 'i')
+    {
+      input = optarg;
+    }
+    else
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      exit(1);
+    }
+  }
+  if (optind >= argc)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
+  }
+  int pipefd[2];
+  if (pipe(pipefd) < 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
+  }
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  pid_t shell = fork();
+  if (shell < 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
+  }
+  else if (shell == 0)
+  {
+    dup2(pipefd[1], STAMP_FD);
+    if (pipefd[0] != STAMP_FD)
+      close(pipefd[0]);
+    if (pipefd[1] != STAMP_FD)
+      close(pipefd[1]);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO); // The shells' own output isn't what is measured
+    close(null);
+    if (input != NULL)
+    {
+      int in = open(input, O_RDONLY);
+      if (in < 0)
+        _exit(127);
+      dup2(in, STDIN_FILENO);
+      close(in);
+    }
+    execv(argv[optind], &argv[optind]);
+    _exit(127);
+  }
+  close(pipefd[1]);
+  // Read until every holder of the pipe (the shell and its commands) has gone
+  char buffer[65536], partial[32];
+  size_t partial_len = 0;
+  long peak = 0;
+  struct pollfd reader = {pipefd[0], POLLIN, 0};
+  while (1)
+  {
+    int ready = poll(&reader, 1, SAMPLE_MS);
+    long kb = read_hwm(shell);
+    if (kb > peak)
+      peak = kb;
+    if (ready <= 0)
+      continue;
+    ssize_t got = read(pipefd[0], buffer, sizeof(buffer));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    parse_stamps(buffer, got, partial, &partial_len);
+  }
+  int wstatus;
+  waitpid(shell, &wstatus, 0);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+  // Command to command latency: the gaps between successive starts
+  qsort(stamps, stamp_count, sizeof(stamps[0]), compare_stamps);
+  size_t gaps = stamp_count > 1 ? stamp_count - 1 : 0;
+  size_t i;
+  for (i = 0; i < gaps; i++)
+    stamps[i] = stamps[i + 1] - stamps[i];
+  qsort(stamps, gaps, sizeof(stamps[0]), compare_stamps);
+  printf("%zu\t%.3f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%ld\n", stamp_count, seconds, stamp_count / seconds,
+         percentile_us(stamps, gaps, 50), percentile_us(stamps, gaps, 90), percentile_us(stamps, gaps, 99),
+         percentile_us(stamps, gaps, 100), peak);
+  return 0;
+}
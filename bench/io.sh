@@ -0,0 +1,58 @@
+#!/bin/sh
+# Captured-output benchmark: system calls the shell makes per MB it moves.
+#
+#   bench/io.sh [-o results.tsv] [-c commands] [-m megabytes-per-command]
+#
+# Runs one '&' group of `cat` commands under --capture=ordered and --capture=prefix with
+# --io=epoll and --io=uring, counting the shell's own syscalls (not the commands') with
+# bench/syscount, which uses ptrace and is x86-64 only. Each row of the results file is
+#
+#   io capture megabytes syscalls syscalls_per_mb seconds
+set -e
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+commands=8
+megabytes=16
+results=bench/io.tsv
+while getopts o:c:m: opt; do
+  case $opt in
+    o) results=$OPTARG ;;
+    c) commands=$OPTARG ;;
+    m) megabytes=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d /tmp/wio.XXXXXX)
+trap 'rm -rf "$work"' EXIT
+
+$CC $CFLAGS -o "$work/wish" "$root/final.c" "$root/libwish.c"
+$CC $CFLAGS -o "$work/syscount" "$root/bench/syscount.c"
+
+# 80 byte lines, so prefix mode has real lines to cut
+awk -v mb="$megabytes" 'BEGIN {
+  line = sprintf("%079d", 0)
+  for (i = 0; i < mb * 1048576 / 80; i++) print line
+}' > "$work/data"
+awk -v n="$commands" -v data="$work/data" 'BEGIN {
+  line = "cat " data
+  for (i = 1; i < n; i++) line = line " & cat " data
+  print "path /bin /usr/bin"
+  print line
+}' > "$work/group"
+moved=$(($(wc -c < "$work/data") * commands))
+
+printf 'io\tcapture\tmegabytes\tsyscalls\tsyscalls_per_mb\tseconds\n' > "$results"
+for capture in ordered prefix; do
+  for io in epoll uring; do
+    started=$(date +%s.%N)
+    total=$("$work/syscount" "$work/wish" --max-jobs="$commands" --capture=$capture --io=$io "$work/group" 2>&1 > /dev/null | awk '$1 == "total" { print $2 }')
+    finished=$(date +%s.%N)
+    awk -v io=$io -v capture=$capture -v moved="$moved" -v total="$total" -v s="$started" -v f="$finished" 'BEGIN {
+      mb = moved / 1048576
+      printf "%s\t%s\t%.0f\t%d\t%.1f\t%.3f\n", io, capture, mb, total, total / mb, f - s
+    }' | tee -a "$results"
+  done
+done
@@ -0,0 +1,114 @@
+#!/bin/sh
+# Launch/throughput benchmark for the three shells.
+#
+#   bench/run.sh [-o results.tsv] [-b baseline.tsv] [-n commands]
+#
+# Builds final.c with libwish.c, Version_redirect.c and Dynamic_allocate.c with
+# $CC, generates the workloads below into a scratch directory and runs every
+# shell over every workload it can run, through bench/driver. Each row of the results file is
+#
+#   variant workload commands seconds cmds/s p50_us p90_us p99_us max_us peak_rss_kb
+#
+# where the latencies are the gaps between successive command starts as seen
+# by bench/stamp, and peak RSS is the shell's own VmHWM, not its children's.
+# With -b, cmds/s and p50 are also printed next to the baseline's.
+#
+# Extra flags for final.c go in $WISH_FLAGS (e.g. WISH_FLAGS="--launch=fork").
+set -e
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+commands=10000
+results=bench/results.tsv
+baseline=
+while getopts o:b:n: opt; do
+  case $opt in
+    o) results=$OPTARG ;;
+    b) baseline=$OPTARG ;;
+    n) commands=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d /tmp/wb.XXXXXX)
+trap 'rm -rf "$work"' EXIT
+mkdir -p "$work/bin" "$work/out" "$work/shells"
+
+$CC $CFLAGS -o "$work/shells/final" "$root/final.c" "$root/libwish.c"
+$CC $CFLAGS -w -o "$work/shells/redirect" "$root/Version_redirect.c"
+$CC $CFLAGS -w -o "$work/shells/dynamic" "$root/Dynamic_allocate.c"
+$CC $CFLAGS -o "$work/bin/stamp" "$root/bench/stamp.c"
+$CC $CFLAGS -o "$work/driver" "$root/bench/driver.c"
+
+# Every workload starts by pointing the shell at bench/stamp only
+awk -v n="$commands" -v bin="$work/bin" 'BEGIN {
+  print "path " bin
+  for (i = 0; i < n; i++) print "stamp"
+}' > "$work/trivial"
+
+# 64 commands per line, all started before any is waited for
+awk -v n="$commands" -v bin="$work/bin" 'BEGIN {
+  print "path " bin
+  for (i = 0; i < n / 64; i++)
+  {
+    line = "stamp"
+    for (j = 1; j < 64; j++) line = line " & stamp"
+    print line
+  }
+}' > "$work/wide"
+
+# 18 directories searched before the one holding stamp (Dynamic_allocate.c
+# holds at most 19 PATH entries)
+awk -v n="$commands" -v bin="$work/bin" -v dirs="$work/p" 'BEGIN {
+  line = "path"
+  for (i = 0; i < 18; i++) { line = line " " dirs i; system("mkdir -p " dirs i) }
+  print line " " bin
+  for (i = 0; i < n; i++) print "stamp"
+}' > "$work/longpath"
+
+# Every command truncates and reopens one of 100 files
+awk -v n="$commands" -v bin="$work/bin" -v out="$work/out" 'BEGIN {
+  print "path " bin
+  for (i = 0; i < n; i++) print "stamp > " out "/" i % 100
+}' > "$work/redirect"
+
+# ~16 KB lines of arguments
+awk -v n="$commands" -v bin="$work/bin" 'BEGIN {
+  print "path " bin
+  args = ""
+  for (i = 0; i < 2000; i++) args = args " arg" i
+  for (i = 0; i < n / 10; i++) print "stamp" args
+}' > "$work/longline"
+
+for workload in trivial wide longpath redirect longline; do
+  # Dynamic_allocate.c only reads stdin, loops on EOF and has no '&'
+  { cat "$work/$workload"; echo exit; } > "$work/$workload.stdin"
+done
+
+: > "$results.tmp"
+for workload in trivial wide longpath redirect longline; do
+  for variant in final redirect dynamic; do
+    case $variant in
+      final) row=$("$work/driver" "$work/shells/final" $WISH_FLAGS "$work/$workload") ;;
+      redirect) row=$("$work/driver" "$work/shells/redirect" "$work/$workload") ;;
+      dynamic)
+        [ "$workload" = wide ] && continue
+        row=$("$work/driver" -i "$work/$workload.stdin" "$work/shells/dynamic") ;;
+    esac
+    printf '%s\t%s\t%s\n' "$variant" "$workload" "$row" | tee -a "$results.tmp"
+  done
+done
+{
+  printf 'variant\tworkload\tcommands\tseconds\tcmds_per_s\tp50_us\tp90_us\tp99_us\tmax_us\tpeak_rss_kb\n'
+  cat "$results.tmp"
+} > "$results"
+rm -f "$results.tmp"
+
+if [ -n "$baseline" ]; then
+  echo
+  echo "variant workload cmds/s (baseline) p50_us (baseline)"
+  awk -F '\t' 'NR == FNR { if (FNR > 1) { rate[$1 " " $2] = $5; p50[$1 " " $2] = $6 } next }
+    FNR > 1 { key = $1 " " $2; printf "%-8s %-9s %8s (%s) %8s (%s)\n", $1, $2, $5, rate[key], $6, p50[key] }' \
+    "$baseline" "$results"
+fi
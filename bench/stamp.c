@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STAMP_FD 3 // Pipe the driver reads, inherited through the shell
+
+// The trivial command every workload runs: report when it got control, then exit
+int main(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  char line[32];
+  int len = snprintf(line, sizeof(line), "%lld\n", (long long)now.tv_sec * 1000000000LL + now.tv_nsec);
+  write(STAMP_FD, line, len); // Shorter than PIPE_BUF, so lines from concurrent stamps never mix
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+Counts the system calls a program makes itself, not those of its children, by stopping
+it at every syscall entry with ptrace. Used by bench/io.sh.
+
+  syscount program [args...]
+
+Prints "total N" and then "name-number count" for each syscall seen, on stderr.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#define MAX_SYSCALLS 512
+
+char error_message[30] = "An error has occurred\n";
+
+static unsigned long counts[MAX_SYSCALLS];
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
+  }
+  else if (pid == 0)
+  {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP); // Let the parent set its options before anything runs
+    execvp(argv[1], &argv[1]);
+    _exit(127);
+  }
+  int wstatus;
+  waitpid(pid, &wstatus, 0);
+  ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+  int entering = 1; // Stops alternate between entry and exit
+  unsigned long total = 0;
+  int deliver = 0;
+  while (1)
+  {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)deliver) < 0)
+      break;
+    deliver = 0;
+    if (waitpid(pid, &wstatus, 0) < 0 || WIFEXITED(wstatus) || WIFSIGNALED(wstatus))
+      break;
+    if (!WIFSTOPPED(wstatus))
+      continue;
+    if (WSTOPSIG(wstatus) != (SIGTRAP | 0x80))
+    {
+      deliver = WSTOPSIG(wstatus) == SIGTRAP ? 0 : WSTOPSIG(wstatus); // Pass real signals on
+      continue;
+    }
+    if (entering)
+    {
+      struct user_regs_struct regs;
+      ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+      unsigned long number = regs.orig_rax;
+      if (number < MAX_SYSCALLS)
+        counts[number]++;
+      total++;
+    }
+    entering = !entering;
+  }
+  fprintf(stderr, "total %lu\n", total);
+  int i;
+  for (i = 0; i < MAX_SYSCALLS; i++)
+  {
+    if (counts[i] > 0)
+      fprintf(stderr, "syscall-%d %lu\n", i, counts[i]);
+  }
+  return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+}
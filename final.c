@@ -1,331 +1,159 @@
+#define _GNU_SOURCE // getopt_long
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <stdbool.h>
-#include <fcntl.h>
-#include <sys/wait.h>
+#include <getopt.h>
+#include "wish.h"
 
-#define MAX_COMMAND 1024
-#define MAX_ARGS 1024
-#define MAX_PATH 100
-#define MAX_PATH_LENGTH 1024
 const char error_message[30] = "An error has occurred\n";
-/*
-paths: all the potential paths (could be invalid)
-path_counter: number of paths
-*/
-// Function to clear the PATH
-void clear_path(char *paths[], size_t *path_counter)
-{
-  int j;
-  for (j = 0; j < *path_counter; j++)
-  {
-    free(paths[j]); // Free each allocated path
-    paths[j] = NULL;
-  }
-  *path_counter = 0;
-}
-/*
-paths: all the potential paths (could be invalid)
-path_counter: number of paths
-*/
-// Function to find the executable in the provided paths
-char *find_executable(char *command, char *paths[], size_t *path_counter)
+int main(int argc, char *argv[])
 {
-  char full_path[MAX_PATH_LENGTH];
-  int i = 0;
-  for (; i < *path_counter; i++)
+  struct shell_options options = WISH_DEFAULT_OPTIONS;
+
+  static struct option long_options[] = {
+      {"launch", required_argument, NULL, 'L'},
+      {"pipe-size", required_argument, NULL, 'P'},
+      {"max-jobs", required_argument, NULL, 'M'},
+      {"stats", no_argument, NULL, 'S'},
+      {"trace", required_argument, NULL, 'T'},
+      {"external", no_argument, NULL, 'E'},
+      {"capture", required_argument, NULL, 'C'},
+      {"io", required_argument, NULL, 'I'},
+      {"memo", required_argument, NULL, 'R'},
+      {"compile", no_argument, NULL, 'K'},
+      {"read-ahead", required_argument, NULL, 'A'},
+      {"server", required_argument, NULL, 'D'},
+      {"client", required_argument, NULL, 'N'},
+      {"affinity", required_argument, NULL, 'F'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  opterr = 0; // Report bad options with the usual error message
+  while ((opt = getopt_long(argc, argv, "j:n", long_options, NULL)) != -1)
   {
-    snprintf(full_path, sizeof(full_path), "%s/%s", paths[i], command); // Construct the full path
-    if (access(full_path, X_OK) == 0)
-    {                           // Check if the command is executable
-      return strdup(full_path); // Return a copy of the full path
+    if (opt == 'L' && strcmp(optarg, "spawn") == 0)
+    {
+      options.launch = LAUNCH_SPAWN;
     }
-  }
-  return NULL; // Return NULL if not found
-}
-/*
-args: Stack allocated arguments
-paths: all the potential paths (could be invalid)
-path_counter: number of paths
-redirection: flag to check if redirect
-output_file: file descriptor to redirect
-*/
-void execute_command(char **args, char *paths[], size_t *path_counter, bool redirection, char *output_file)
-{
-  char *executable = find_executable(args[0], paths, path_counter);
-  if (executable == NULL)
-  {
-    write(STDERR_FILENO, error_message, strlen(error_message));
-    return;
-  }
-  pid_t rc = fork();
-  if (rc < 0)
-  {
-    write(STDERR_FILENO, error_message, strlen(error_message));
-    return;
-  }
-  else if (rc == 0)
-  {
-    if (redirection)
+    else if (opt == 'L' && strcmp(optarg, "fork") == 0)
     {
-      int fd = open(output_file, O_WRONLY | O_TRUNC | O_CREAT, S_IRWXU);
-      if (fd < 0)
-      {
-        write(STDERR_FILENO, error_message, strlen(error_message));
-        return;
-      }
-      // Assign fd to stdout and stderr, so all messages will be redirected to the file,
-      dup2(fd, STDOUT_FILENO);
-      dup2(fd, STDERR_FILENO);
-      close(fd); // Close the original fd
+      options.launch = LAUNCH_FORK;
     }
-    execv(executable, args);
-    write(STDERR_FILENO, error_message, strlen(error_message));
-    exit(1);
-  }
-  free(executable);
-}
-void builtin(char **args, int args_count, char *paths[], size_t *path_counter)
-{
-  if (strcmp(args[0], "exit") == 0)
-  {
-    if (args_count > 1)
+    else if (opt == 'L' && strcmp(optarg, "prefork") == 0)
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      return;
+      options.launch = LAUNCH_PREFORK;
     }
-    exit(0);
-  }
-  else if (strcmp(args[0], "cd") == 0)
-  {
-    if (args_count != 2)
+    else if (opt == 'P' && atoi(optarg) > 0)
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      return;
+      options.pipe_size = atoi(optarg);
     }
-    else if (chdir(args[1]) != 0) // Error in changing directory
+    else if (opt == 'M' && atoi(optarg) > 0)
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
+      options.max_jobs = atoi(optarg);
     }
-  }
-  else if (strcmp(args[0], "path") == 0)
-  {
-    clear_path(paths, path_counter);
-    int i;
-    for (i = 1; i < args_count; i++)
+    else if (opt == 'j' && atoi(optarg) > 0)
     {
-      paths[(*path_counter)] = strdup(args[i]); // Don't check, that is for find_executable
-      (*path_counter)++;
+      options.batch_jobs = atoi(optarg);
     }
-  }
-}
-/*
-string: Entire Line
-paths: all the potential paths (could be invalid)
-path_counter: number of paths
-
-*/
-void process_line(char *string, char *paths[], size_t *path_counter, bool interactive)
-{
-  char *commands[MAX_COMMAND];
-  int command_count = 0;
-  char *command_token = NULL;
-  // Check to see if there are multiple commands
-  string[strcspn(string, "\n")] = 0;
-  if (string[0] == '&')
-  {
-    write(STDERR_FILENO, error_message, strlen(error_message));
-    return;
-  }
-  // For & sign inbetween a word
-  char *current = string; // starting from 0
-  while (*current != '\0' && command_count < MAX_COMMAND - 1)
-  {                                   // Don't go out of bound and not terminal
-    char *end = strchr(current, '&'); // Search for '&'
-    if (end == NULL)
+    else if (opt == 'n')
     {
-      command[command_count++] = current; // It means no '&'
+      options.check_only = true;
     }
-    *end = '\0';        // Got some result and change it
-    if (end == current) // If they happened to be the same, then there's something wrong, zero input
+    else if (opt == 'K')
     {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      return;
+      options.compile = true;
     }
-    commands[command_count++] = current; // A valid result from start -----\0
-    current = end + 1;
-  }
-
-  pid_t children[MAX_COMMAND] = {0}; // Children Arr
-  int child_count = 0;
-  // For every command, we execute them
-  int cmd = 0;
-  for (; cmd < command_count; cmd++)
-  {
-    int args_count = 0;
-    char *args[MAX_ARGS];     // command  + arguments
-    bool redirection = false; // If redirection
-    char *output_file = NULL;
-
-    char *current_arg = commands[cmd];                        // First Letter
-    while (*current_arg != '\0' && args_count < MAX_ARGS - 1) // '\0' end of the string, and not out of bound
+    else if (opt == 'A' && atoi(optarg) > 0)
     {
-      while (*current_arg == ' ' || *current_arg == ' \t') // Disregard all the spaces
-      {
-        current_arg++;
-      }
-      if (*current_arg == '>')
-      {
-        if (redirection || args_count == 0) // If there's a previous redirection '>>' or no src
-        {
-          write(STDERR_FILENO, error_message, strlen(error_message));
-          return;
-        }
-
-        redirection = true;
-        current_arg++;
-        // looking for a dst
-        while (*current_arg == ' ' || *current_arg == ' \t')
-        {
-          current_arg++;
-        }
-        // IF the first thing comes after blanks is terminate sign
-        if (*current_arg == '\0')
-        {
-          write(STDERR_FILENO, error_message, strlen(error_message));
-          return;
-        }
-        output_file = current_arg; // Redirect file starts from here
-        break;
-      }
-      args[args_count++] = current_arg;
-
-      // At this point, it is a command_+'>'+redirect_file
-      // first part command
-      while (*current_arg != ' ' && *current_arg != '\t' && *current_arg != '>' && *current_arg != '\0')
-      {
-        current_arg++;
-      }
-      if (*current_arg == '>') // Go back to the beginning and do redirect_file part
-        continue;
-
-      if (*current_arg != '\0')
-      {
-        *current_arg = '\0';
-        current_arg++;
-      }
+      options.read_ahead = atoi(optarg);
     }
-
-    args[args_count] = NULL;
-    // If there's zero arg, just go to the next round.
-    if (args_count == 0)
-      continue;
-
-    if (strcmp(args[0], "exit") == 0 || strcmp(args[0], "cd") == 0 || strcmp(args[0], "path") == 0)
+    else if (opt == 'D')
     {
-      builtin(args, args_count, paths, path_counter);
+      options.server = optarg;
+    }
+    else if (opt == 'N')
+    {
+      options.client = optarg;
+    }
+    else if (opt == 'S')
+    {
+      options.stats = true;
+    }
+    else if (opt == 'E')
+    {
+      options.external = true;
+    }
+    else if (opt == 'C' && strcmp(optarg, "ordered") == 0)
+    {
+      options.capture = CAPTURE_ORDERED;
+    }
+    else if (opt == 'C' && strcmp(optarg, "prefix") == 0)
+    {
+      options.capture = CAPTURE_PREFIX;
+    }
+    else if (opt == 'F' && strcmp(optarg, "spread") == 0)
+    {
+      options.affinity = AFFINITY_SPREAD;
+    }
+    else if (opt == 'F' && strcmp(optarg, "compact") == 0)
+    {
+      options.affinity = AFFINITY_COMPACT;
+    }
+    else if (opt == 'F' && strcmp(optarg, "numa") == 0)
+    {
+      options.affinity = AFFINITY_NUMA;
+    }
+    else if (opt == 'I' && strcmp(optarg, "epoll") == 0)
+    {
+      options.io = IO_EPOLL;
+    }
+    else if (opt == 'I' && strcmp(optarg, "uring") == 0)
+    {
+      options.io = IO_URING;
+    }
+    else if (opt == 'T')
+    {
+      options.trace = optarg;
+    }
+    else if (opt == 'R')
+    {
+      options.memo = optarg; // Replays results of commands declared with the pure builtin
     }
     else
     {
-      pid_t pid = fork();
-      if (pid == 0)
-      {
-        if (redirection)
-        {
-          int fd = open(output_file, O_WRONLY | O_TRUNC | O_CREAT, S_IRWXU);
-          if (fd < 0)
-          {
-            write(STDERR_FILENO, error_message, strlen(error_message));
-            exit(1);
-          }
-          // Assign fd to stdout and stderr, so all messages will be redirected to the file,
-          dup2(fd, STDOUT_FILENO);
-          dup2(fd, STDERR_FILENO);
-          close(fd); // Close the original fd
-        }
-        char *executable = find_executable(args[0], paths, path_counter);
-        if (executable == NULL)
-        {
-          write(STDERR_FILENO, error_message, strlen(error_message));
-          exit(1);
-        }
-        execv(executable, args);
-        write(STDERR_FILENO, error_message, strlen(error_message));
-        exit(1);
-      }
-      else if (pid > 0)
-      {
-        children[child_count++] = pid;
-      }
-      else
-      {
-        write(STDERR_FILENO, error_message, strlen(error_message));
-      }
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      exit(1);
     }
   }
-  // Waiting for all the children
-  int i;
-  for (i = 0; i < child_count; i++)
+  if (!wish_init(&options))
   {
-    waitpid(children[i], NULL, 0);
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
   }
-}
-
-int main(int argc, char *argv[])
-{
-  char *paths[MAX_PATH] = {strdup("/bin")}; // Initialize with /bin
-  size_t path_counter = 1;                  // Path count
+  argc -= optind - 1; // Leave only the program name and the batch file
+  argv += optind - 1;
 
-  if (argc > 2)
+  if (argc > 2 || (options.server != NULL && (argc > 1 || options.client != NULL)))
   {
     write(STDERR_FILENO, error_message, strlen(error_message));
     exit(1);
   }
-  else if (argc == 2) // This is batch mode
+  else if (options.server != NULL)
   {
-    FILE *batch = fopen(argv[1], "r");
-    if (batch == NULL)
-    {
-      write(STDERR_FILENO, error_message, strlen(error_message));
-      exit(1);
-    }
-    char *string = NULL;
-    size_t len = 0;
-    ssize_t read;
-
-    while ((read = getline(&string, &len, batch)) != -1) // For every line, treat it as an keyboard input + ENTER
-    {
-      process_line(string, paths, &path_counter, false);
-    }
-    free(string);
-    fclose(batch);
+    return wish_serve(options.server);
   }
-  else
+  else if (options.client != NULL)
   {
-    while (1)
-    {
-      fflush(stdout);
-      char *string = NULL;
-      size_t len = 0;
-      ssize_t read;
-
-      if ((read = getline(&string, &len, stdin)) == -1)
-      {
-        if (feof(stdin))
-        {
-          printf("\n");
-          exit(0);
-        }
-
-        write(STDERR_FILENO, error_message, strlen(error_message));
-        exit(1);
-      }
-      process_line(string, paths, &path_counter, true);
-      free(string);
-    }
+    return wish_client(options.client, argc == 2 ? argv[1] : NULL);
+  }
+  struct wish *shell = wish_new();
+  if (shell == NULL)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    exit(1);
   }
-  clear_path(paths, &path_counter);
-  return 0;
+  // argc == 2 is batch mode, otherwise treat stdin as keyboard input
+  int status = argc == 2 ? wish_batch(shell, argv[1]) : wish_interactive(shell);
+  wish_free(shell);
+  return status;
 }
@@ -0,0 +1,6285 @@
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ, splice, tee
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "wish.h"
+
+#define MAX_PATH 100
+#define MAX_PATH_LENGTH 1024
+#define MAX_BACKGROUND 64             // Background jobs the interactive shell keeps track of
+#define MAX_TARGETS 16                // Redirect targets tracked per line in -j batch mode
+#define TEE_CHUNK 65536               // Bytes a '|>' stream moves per read() once splice is refused
+#define CAPTURE_SPILL 65536           // Bytes a captured stream holds in memory before going to a temp file
+#define URING_BUFFERS 32              // Capture pipes io_uring reads at once, one registered buffer each
+#define URING_BUFFER 65536            // Size of each of those buffers
+#define PREFORK_MAX 16                // Zygotes --launch=prefork keeps ready at most
+#define PREFORK_WINDOW 32             // Launches between two resizes of the zygote pool
+#define PREFORK_MESSAGE 65536         // Bytes of path and arguments a zygote takes, longer commands are spawned
+#define MEMO_KEY 8192                 // Bytes of path, argv, cwd and file stamps a memoized command is keyed by
+#define BATCH_CHUNK 65536             // read() size when the batch script can't be mapped
+#define ARENA_CHUNK 16384             // Smallest block the line arena asks malloc for
+#define STATS_SLOWEST 5               // Commands listed in the --stats batch summary
+#define STATS_TEXT 80                 // Characters of a command kept for the summary
+#define TRACE_EVENTS 4096             // Events buffered per process before a write()
+#define TRACE_DETAIL 32               // Characters of detail kept per event
+#define HASH_INITIAL_SIZE 64          // Slots in the command cache, always a power of two
+#define HASH_RECHECK_NS 1000000000L   // Compare PATH directory mtimes at most once per second
+static const char error_message[30] = "An error has occurred\n";
+/*
+name: command name as typed, the key
+full_path: where find_executable found it
+hits: number of lookups served from the cache
+*/
+struct hash_entry
+{
+  char *name;
+  char *full_path;
+  unsigned hits;
+};
+/*
+entries: open addressing table, NULL name means empty slot
+size: number of slots
+count: number of used slots
+dir_mtime: mtime of every PATH directory when the cache was last validated
+checked: last time dir_mtime was compared (CLOCK_MONOTONIC_COARSE)
+*/
+struct hash_table
+{
+  struct hash_entry *entries;
+  size_t size;
+  size_t count;
+  struct timespec dir_mtime[MAX_PATH];
+  struct timespec checked;
+};
+static struct hash_table command_hash; // Resolved command cache, like bash's hash
+/*
+next: following chunk, kept across resets
+size: bytes in data
+data: the memory handed out
+*/
+struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t size;
+  max_align_t data[];
+};
+/*
+first: oldest chunk, where a reset starts over
+current: chunk being filled
+used: bytes of current handed out
+*/
+struct arena
+{
+  struct arena_chunk *first;
+  struct arena_chunk *current;
+  size_t used;
+};
+static __thread struct arena line_arena; // Per-line parse state: tokens, commands, child tables, resolved paths; the --read-ahead parser has its own
+/*
+ts: CLOCK_MONOTONIC in nanoseconds
+pid: process that recorded it
+phase: 'B' begin, 'E' end, 'i' instant, as in the Chrome trace-event format
+name: what happened, always a string literal
+detail: command name or pid, cut at TRACE_DETAIL
+ready: set once the slot is completely written
+*/
+struct trace_event
+{
+  uint64_t ts;
+  pid_t pid;
+  char phase;
+  const char *name;
+  char detail[TRACE_DETAIL];
+  int ready;
+};
+/*
+fd: where events go, -1 when tracing is off
+csv: CSV rows instead of Chrome trace-event JSON
+used: slots claimed so far, taken with an atomic add so recording never locks
+flushing: held by the thread writing the buffer out, so two flushes never interleave
+events: this process's buffer, a forked child starts over with an empty one
+*/
+struct tracer
+{
+  int fd;
+  bool csv;
+  unsigned used;
+  int flushing;
+  struct trace_event events[TRACE_EVENTS];
+};
+static struct tracer tracer = {-1, false, 0, 0, {{0}}};
+// Costs a single predictable branch when tracing is off
+#define TRACE(phase, name, detail)                   \
+  do                                                 \
+  {                                                  \
+    if (__builtin_expect(tracer.fd >= 0, 0))         \
+      trace_event((phase), (name), (detail));        \
+  } while (0)
+static struct shell_options options = WISH_DEFAULT_OPTIONS;
+/*
+wall: seconds from launch to the last stage being reaped
+text: the command as written, cut at STATS_TEXT
+*/
+struct stats_entry
+{
+  double wall;
+  char text[STATS_TEXT];
+};
+/*
+line_number: line of the batch script being run, set by the caller of process_line
+commands, failed, user, sys, maxrss: totals for the current line
+total_*: totals for the whole run
+slowest: the longest commands so far, slowest first
+*/
+struct shell_stats
+{
+  size_t line_number;
+  size_t commands;
+  size_t failed;
+  double user;
+  double sys;
+  long maxrss;
+  size_t total_lines;
+  size_t total_commands;
+  size_t total_failed;
+  double total_wall;
+  double total_user;
+  double total_sys;
+  long total_maxrss;
+  struct stats_entry slowest[STATS_SLOWEST];
+  int slowest_count;
+};
+static struct shell_stats stats; // Filled only with --stats
+/*
+epoll_fd: waits for SIGCHLD and, at the interactive prompt, for input; -1 falls back to
+blocking waitid
+signal_fd: SIGCHLD, which stays blocked so it is only ever delivered here
+input: stdin is registered too, false when it can't be (a regular file is always readable)
+*/
+struct event_loop
+{
+  int epoll_fd;
+  int signal_fd;
+  bool input;
+};
+static struct event_loop events = {-1, -1, false};
+static posix_spawnattr_t spawn_attr; // Clears the blocked SIGCHLD in every spawned command
+/*
+pids, count, capacity: the children started here and not reaped yet: commands, zygotes and
+their maker, -j workers and wish_start() lines. Only these are ever waited for, so the other
+children of a program using the library stay its own to reap
+*/
+struct own_children
+{
+  pid_t *pids;
+  int count;
+  int capacity;
+};
+static struct own_children own;
+// Function to make room for one more child before starting it, false if there is none
+static bool own_reserve(void)
+{
+  if (own.count < own.capacity)
+    return true;
+  int capacity = own.capacity == 0 ? 64 : own.capacity * 2;
+  pid_t *grown = realloc(own.pids, capacity * sizeof(pid_t));
+  if (grown == NULL)
+    return false;
+  own.pids = grown;
+  own.capacity = capacity;
+  return true;
+}
+// Function to forget a child that was reaped, the order of the others doesn't matter
+static void own_remove(pid_t pid)
+{
+  int i;
+  for (i = own.count - 1; i >= 0; i--)
+  {
+    if (own.pids[i] == pid)
+    {
+      own.pids[i] = own.pids[--own.count];
+      return;
+    }
+  }
+}
+/*
+wstatus, usage: as from wait4, usage may be NULL
+Never blocks
+Returns one of our children that has exited, 0 if none has yet, -1 when there are none left
+*/
+static pid_t own_reap(int *wstatus, struct rusage *usage)
+{
+  if (own.count == 0)
+    return -1;
+  siginfo_t info;
+  info.si_pid = 0;
+  // Peek at the first exited child without reaping it: usually ours, and then it's one wait4
+  if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) != 0)
+  {
+    if (errno != ECHILD)
+      return 0;
+    own.count = 0; // The program reaped them itself, nothing left to wait for
+    return -1;
+  }
+  if (info.si_pid == 0)
+    return 0;
+  pid_t pid = 0;
+  int i;
+  for (i = own.count - 1; i >= 0 && own.pids[i] != info.si_pid; i--)
+    ;
+  if (i >= 0)
+    pid = wait4(info.si_pid, wstatus, WNOHANG, usage);
+  for (i = own.count - 1; i >= 0 && pid <= 0; i--)
+    pid = wait4(own.pids[i], wstatus, WNOHANG, usage); // The program's zombie is first in line, ask each of ours
+  if (pid <= 0)
+    return 0;
+  own_remove(pid);
+  return pid;
+}
+extern char **environ;
+/*
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+*/
+// Function to clear the PATH
+static void clear_path(char *paths[], size_t *path_counter)
+{
+  int j;
+  for (j = 0; j < *path_counter; j++)
+  {
+    free(paths[j]); // Free each allocated path
+    paths[j] = NULL;
+  }
+  *path_counter = 0;
+}
+/*
+arena: the arena to carve from
+size: bytes wanted
+Returns memory valid until the next arena_reset, NULL if malloc fails
+*/
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  while (arena->current == NULL || arena->used + size > arena->current->size)
+  {
+    struct arena_chunk *next = arena->current != NULL ? arena->current->next : arena->first;
+    if (next == NULL || next->size < size)
+    {
+      // Out of kept chunks: a line bigger than any before, only then malloc
+      size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+      struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+      if (chunk == NULL)
+        return NULL; // The caller fails the line, a program embedding the library goes on
+      chunk->size = chunk_size;
+      chunk->next = next;
+      if (arena->current != NULL)
+        arena->current->next = chunk;
+      else
+        arena->first = chunk;
+      next = chunk;
+    }
+    arena->current = next;
+    arena->used = 0;
+  }
+  void *memory = (char *)arena->current->data + arena->used;
+  arena->used += size;
+  return memory;
+}
+/*
+arena: the arena array lives in
+array: current storage, NULL to start
+count: elements in use
+capacity: elements array can hold, updated when it grows
+size: size of one element
+Returns array with room for one more element, moved and doubled if it was full; NULL if
+that fails, array is left as it was
+*/
+static void *arena_push(struct arena *arena, void *array, size_t count, size_t *capacity, size_t size)
+{
+  if (count < *capacity)
+    return array;
+  size_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+  void *bigger = arena_alloc(arena, new_capacity * size);
+  if (bigger == NULL)
+    return NULL;
+  if (count > 0)
+    memcpy(bigger, array, count * size); // The old copy is reclaimed by the reset
+  *capacity = new_capacity;
+  return bigger;
+}
+// Function to copy a string into the arena, NULL if there is no room
+static char *arena_strdup(struct arena *arena, const char *string)
+{
+  size_t len = strlen(string) + 1;
+  char *copy = arena_alloc(arena, len);
+  if (copy != NULL)
+    memcpy(copy, string, len);
+  return copy;
+}
+// Function to give back everything at once, O(1): chunks stay linked for reuse
+static void arena_reset(struct arena *arena)
+{
+  arena->current = arena->first;
+  arena->used = 0;
+}
+/*
+detail: an event's detail, as the command line had it
+out: receives it quoted for the trace, room for TRACE_DETAIL * 6 bytes
+csv: quote it as a CSV field rather than a JSON string
+*/
+static void trace_escape(const char *detail, char *out, bool csv)
+{
+  static const char hex[] = "0123456789abcdef";
+  bool quote = csv && strpbrk(detail, ",\"\r\n") != NULL;
+  if (quote)
+    *out++ = '"';
+  for (; *detail != '\0'; detail++)
+  {
+    unsigned char c = *detail;
+    if (csv)
+    {
+      if (c == '"')
+        *out++ = '"'; // Doubled inside the quotes
+      *out++ = c;
+    }
+    else if (c == '"' || c == '\\')
+    {
+      *out++ = '\\';
+      *out++ = c;
+    }
+    else if (c < 0x20 || c == 0x7f)
+    {
+      memcpy(out, "\\u00", 4);
+      out[4] = hex[c >> 4];
+      out[5] = hex[c & 15];
+      out += 6;
+    }
+    else
+    {
+      *out++ = c;
+    }
+  }
+  if (quote)
+    *out++ = '"';
+  *out = '\0';
+}
+// Function to write every completed event out with one write() per buffer
+static void trace_flush(void)
+{
+  if (tracer.fd < 0 || __atomic_load_n(&tracer.used, __ATOMIC_ACQUIRE) == 0)
+    return;
+  while (__atomic_exchange_n(&tracer.flushing, 1, __ATOMIC_ACQUIRE))
+    sched_yield(); // Another thread is writing the buffer out, ours may be empty after it
+  // Park the count past the end: recorders spin until the slots are free again, and none of
+  // them can claim one that is being written out
+  unsigned used = __atomic_exchange_n(&tracer.used, TRACE_EVENTS + 1, __ATOMIC_ACQ_REL);
+  if (used > TRACE_EVENTS)
+    used = TRACE_EVENTS;
+  char text[TRACE_EVENTS / 16 * 160]; // Formatted in batches of a sixteenth of the buffer
+  char detail[TRACE_DETAIL * 6];
+  size_t len = 0;
+  unsigned i;
+  for (i = 0; i < used; i++)
+  {
+    struct trace_event *event = &tracer.events[i];
+    while (!__atomic_load_n(&event->ready, __ATOMIC_ACQUIRE))
+      ; // Another thread is still filling the slot it claimed
+    trace_escape(event->detail, detail, tracer.csv);
+    if (tracer.csv)
+      len += snprintf(text + len, sizeof(text) - len, "%llu,%d,%c,%s,%s\n", (unsigned long long)event->ts, (int)event->pid, event->phase, event->name, detail);
+    else
+      len += snprintf(text + len, sizeof(text) - len, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}},\n",
+                      event->name, event->phase, (unsigned long long)(event->ts / 1000), (unsigned long long)(event->ts % 1000), (int)event->pid, (int)event->pid, detail);
+    event->ready = 0;
+    if (len > sizeof(text) - 512 || i == used - 1)
+    {
+      write(tracer.fd, text, len); // O_APPEND: whole batches from different processes never overlap
+      len = 0;
+    }
+  }
+  __atomic_store_n(&tracer.used, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&tracer.flushing, 0, __ATOMIC_RELEASE);
+}
+/*
+phase: 'B', 'E' or 'i'
+name: string literal naming the step
+detail: extra text, may be NULL
+*/
+static void trace_event(char phase, const char *name, const char *detail)
+{
+  unsigned slot;
+  while ((slot = __atomic_fetch_add(&tracer.used, 1, __ATOMIC_ACQ_REL)) >= TRACE_EVENTS)
+  {
+    if (slot == TRACE_EVENTS)
+      trace_flush(); // The one that overflowed empties it, the others retry
+  }
+  struct trace_event *event = &tracer.events[slot];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  event->ts = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+  event->pid = getpid();
+  event->phase = phase;
+  event->name = name;
+  snprintf(event->detail, sizeof(event->detail), "%s", detail != NULL ? detail : "");
+  __atomic_store_n(&event->ready, 1, __ATOMIC_RELEASE);
+  if (slot == TRACE_EVENTS - 1)
+    trace_flush();
+}
+// Function to drop events a forked child inherited, the parent still owns them
+static void trace_after_fork(void)
+{
+  tracer.used = 0;
+  tracer.flushing = 0; // Whoever held it didn't come along
+}
+/*
+target: file name, or fd:N to use an already open descriptor
+CSV when the name ends in .csv, Chrome trace-event JSON (the array form, whose
+closing bracket is optional) otherwise
+Returns false if the file can't be opened
+*/
+static bool trace_open(const char *target)
+{
+  if (strncmp(target, "fd:", 3) == 0)
+  {
+    tracer.fd = atoi(target + 3);
+    int flags = fcntl(tracer.fd, F_GETFL);
+    if (flags >= 0)
+      fcntl(tracer.fd, F_SETFL, flags | O_APPEND); // Children flush to the same file, as with a named one
+  }
+  else
+  {
+    tracer.fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  }
+  if (tracer.fd < 0 || fcntl(tracer.fd, F_GETFD) < 0)
+  {
+    tracer.fd = -1;
+    return false;
+  }
+  size_t len = strlen(target);
+  tracer.csv = len > 4 && strcmp(target + len - 4, ".csv") == 0;
+  const char *header = tracer.csv ? "ts_ns,pid,phase,name,detail\n" : "[\n";
+  write(tracer.fd, header, strlen(header));
+  atexit(trace_flush);
+  return true;
+}
+// FNV-1a, good enough for short command names
+static size_t hash_string(const char *string)
+{
+  size_t h = 2166136261u;
+  for (; *string != '\0'; string++)
+  {
+    h ^= (unsigned char)*string;
+    h *= 16777619u;
+  }
+  return h;
+}
+// Function to drop every cached command, keeps the table allocated
+static void hash_clear(void)
+{
+  size_t i;
+  for (i = 0; i < command_hash.size; i++)
+  {
+    free(command_hash.entries[i].name);
+    free(command_hash.entries[i].full_path);
+  }
+  if (command_hash.entries != NULL)
+  {
+    memset(command_hash.entries, 0, command_hash.size * sizeof(struct hash_entry));
+  }
+  command_hash.count = 0;
+  command_hash.checked.tv_sec = 0; // Force the next lookup to snapshot the directories again
+  command_hash.checked.tv_nsec = 0;
+}
+/*
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+dir_mtime, checked: what the cache last saw, updated here
+Returns true if any PATH directory changed since then; looks at most once per HASH_RECHECK_NS,
+checked zero forces a look
+*/
+static bool dirs_changed(char *paths[], size_t path_counter, struct timespec dir_mtime[], struct timespec *checked)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now); // vDSO, no syscall
+  long elapsed = (now.tv_sec - checked->tv_sec) * 1000000000L + (now.tv_nsec - checked->tv_nsec);
+  if ((checked->tv_sec != 0 || checked->tv_nsec != 0) && elapsed < HASH_RECHECK_NS)
+  {
+    return false;
+  }
+  bool changed = false;
+  size_t i;
+  for (i = 0; i < path_counter; i++)
+  {
+    struct stat st;
+    struct timespec mtime = {0, 0}; // Missing directory keeps a zero mtime
+    if (stat(paths[i], &st) == 0)
+    {
+      mtime = st.st_mtim;
+    }
+    if (mtime.tv_sec != dir_mtime[i].tv_sec || mtime.tv_nsec != dir_mtime[i].tv_nsec)
+    {
+      changed = true;
+      dir_mtime[i] = mtime;
+    }
+  }
+  *checked = now;
+  return changed;
+}
+// Function to sum up PATH directory mtimes, so two threads' snapshots compare in one go
+static uint64_t dirs_stamp(const struct timespec dir_mtime[], size_t path_counter)
+{
+  uint64_t stamp = 14695981039346656037ULL; // FNV-1a over the nanoseconds
+  size_t i;
+  for (i = 0; i < path_counter; i++)
+    stamp = (stamp ^ ((uint64_t)dir_mtime[i].tv_sec * 1000000000ULL + dir_mtime[i].tv_nsec)) * 1099511628211ULL;
+  return stamp;
+}
+/*
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+*/
+// Function to flush the cache if any PATH directory changed since it was filled
+static void hash_check_dirs(char *paths[], size_t *path_counter)
+{
+  if (dirs_changed(paths, *path_counter, command_hash.dir_mtime, &command_hash.checked) && command_hash.count > 0)
+  {
+    struct timespec checked = command_hash.checked;
+    hash_clear();
+    command_hash.checked = checked; // The directories were just looked at
+  }
+}
+// Function to find the slot holding command, or the empty slot where it belongs
+static struct hash_entry *hash_slot(const char *command)
+{
+  size_t mask = command_hash.size - 1;
+  size_t i = hash_string(command) & mask;
+  while (command_hash.entries[i].name != NULL && strcmp(command_hash.entries[i].name, command) != 0)
+  {
+    i = (i + 1) & mask; // Linear probing, hash_remove keeps every chain unbroken
+  }
+  return &command_hash.entries[i];
+}
+// Function to drop one cached command, shifting the entries probed past it back into its slot
+static void hash_remove(const char *command)
+{
+  if (command_hash.count == 0)
+    return;
+  struct hash_entry *entry = hash_slot(command);
+  if (entry->name == NULL)
+    return;
+  free(entry->name);
+  free(entry->full_path);
+  size_t mask = command_hash.size - 1;
+  size_t hole = entry - command_hash.entries;
+  size_t i = hole;
+  while (command_hash.entries[i = (i + 1) & mask].name != NULL)
+  {
+    size_t home = hash_string(command_hash.entries[i].name) & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) // Its probe passed the hole, it may move up
+    {
+      command_hash.entries[hole] = command_hash.entries[i];
+      hole = i;
+    }
+  }
+  memset(&command_hash.entries[hole], 0, sizeof(struct hash_entry));
+  command_hash.count--;
+}
+// Function to remember where command lives, grows the table at 50% load
+static struct hash_entry *hash_insert(const char *command, const char *full_path)
+{
+  if (command_hash.count * 2 >= command_hash.size)
+  {
+    struct hash_entry *old = command_hash.entries;
+    size_t old_size = command_hash.size;
+    size_t new_size = old_size == 0 ? HASH_INITIAL_SIZE : old_size * 2;
+    struct hash_entry *entries = calloc(new_size, sizeof(struct hash_entry));
+    if (entries == NULL)
+    {
+      return NULL; // Caching is only an optimization
+    }
+    command_hash.entries = entries;
+    command_hash.size = new_size;
+    size_t i;
+    for (i = 0; i < old_size; i++)
+    {
+      if (old[i].name != NULL)
+      {
+        *hash_slot(old[i].name) = old[i];
+      }
+    }
+    free(old);
+  }
+  struct hash_entry *entry = hash_slot(command);
+  entry->name = strdup(command);
+  entry->full_path = strdup(full_path);
+  entry->hits = 0;
+  command_hash.count++;
+  return entry;
+}
+/*
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Returns the full path in line_arena, or NULL
+*/
+// Function to find the executable in the provided paths
+static char *find_executable(char *command, char *paths[], size_t *path_counter)
+{
+  hash_check_dirs(paths, path_counter);
+  if (command_hash.count > 0)
+  {
+    struct hash_entry *entry = hash_slot(command);
+    if (entry->name != NULL)
+    {
+      entry->hits++;
+      return arena_strdup(&line_arena, entry->full_path); // Cached, no access() at all
+    }
+  }
+  char full_path[MAX_PATH_LENGTH];
+  int i = 0;
+  for (; i < *path_counter; i++)
+  {
+    snprintf(full_path, sizeof(full_path), "%s/%s", paths[i], command); // Construct the full path
+    if (access(full_path, X_OK) == 0)
+    {                                      // Check if the command is executable
+      struct hash_entry *entry = hash_insert(command, full_path);
+      if (entry != NULL)
+      {
+        entry->hits++;
+      }
+      return arena_strdup(&line_arena, full_path); // Return a copy of the full path, freed with the line
+    }
+  }
+  return NULL; // Return NULL if not found
+}
+/*
+cpus: where the command may run
+node: NUMA node its memory should come from, -1 to leave that to the kernel
+*/
+struct placement
+{
+  cpu_set_t cpus;
+  int node;
+};
+/*
+cpu: its number
+package, core: physical_package_id and core_id from sysfs
+node: its NUMA node, 0 without any
+thread: rank among the CPUs sharing its core
+rank: rank of its core within its package
+*/
+struct cpu_info
+{
+  int cpu;
+  int package;
+  int core;
+  int node;
+  int thread;
+  int rank;
+};
+/*
+loaded: /sys was read, once, by the first command placed
+compact: CPUs the shell may use, siblings of a core side by side, then the cores of a
+package, then the packages
+spread: the same CPUs taking one core of every package in turn, the cores' second threads last
+cpu_count: size of both, 0 if nothing could be read
+node_of: node of every CPU
+nodes, node_count: the NUMA nodes holding any of those CPUs
+*/
+struct topology
+{
+  bool loaded;
+  int compact[CPU_SETSIZE];
+  int spread[CPU_SETSIZE];
+  int cpu_count;
+  int node_of[CPU_SETSIZE];
+  int nodes[CPU_SETSIZE];
+  int node_count;
+};
+static struct topology topology;
+/*
+text: a CPU or node list the way sysfs and taskset write them, like "0-3,8,10-11"
+set: receives its members
+Returns false if it isn't one, or is empty
+*/
+static bool cpu_list(const char *text, cpu_set_t *set)
+{
+  CPU_ZERO(set);
+  while (*text != '\0' && *text != '\n')
+  {
+    char *end;
+    long first = strtol(text, &end, 10);
+    long last = first;
+    if (end == text)
+      return false;
+    if (*end == '-')
+    {
+      text = end + 1;
+      last = strtol(text, &end, 10);
+      if (end == text)
+        return false;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return false;
+    for (; first <= last; first++)
+      CPU_SET(first, set);
+    text = end;
+    if (*text == ',')
+      text++;
+    else if (*text != '\0' && *text != '\n')
+      return false;
+  }
+  return CPU_COUNT(set) > 0;
+}
+// Function to read a sysfs file named by format and number, false if it isn't there
+static bool sysfs_text(const char *format, int number, char *text, size_t size)
+{
+  char name[128];
+  snprintf(name, sizeof(name), format, number);
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t len = read(fd, text, size - 1);
+  close(fd);
+  if (len <= 0)
+    return false;
+  text[len] = '\0';
+  return true;
+}
+// Orders CPUs by node, package, core, then number
+static int cpu_compact_order(const void *a, const void *b)
+{
+  const struct cpu_info *x = a, *y = b;
+  if (x->node != y->node)
+    return x->node - y->node;
+  if (x->package != y->package)
+    return x->package - y->package;
+  if (x->core != y->core)
+    return x->core - y->core;
+  return x->cpu - y->cpu;
+}
+// Orders CPUs by thread within their core, core within their package, then package
+static int cpu_spread_order(const void *a, const void *b)
+{
+  const struct cpu_info *x = a, *y = b;
+  if (x->thread != y->thread)
+    return x->thread - y->thread;
+  if (x->rank != y->rank)
+    return x->rank - y->rank;
+  if (x->package != y->package)
+    return x->package - y->package;
+  return x->cpu - y->cpu;
+}
+// Function to read which CPUs the shell may use and how they sit in cores, packages and nodes
+static void topology_load(void)
+{
+  static struct cpu_info info[CPU_SETSIZE];
+  cpu_set_t allowed, members, nodes;
+  char text[4096];
+  int count = 0, cpu, node, i;
+  topology.loaded = true;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) // taskset and cpusets included
+    return;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    // Without sysfs every CPU is a core of its own, in package 0
+    info[count].cpu = cpu;
+    info[count].package = sysfs_text("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu, text, sizeof(text)) ? atoi(text) : 0;
+    info[count].core = sysfs_text("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, text, sizeof(text)) ? atoi(text) : cpu;
+    info[count++].node = 0;
+  }
+  // A kernel without NUMA has no node directory, everything is node 0
+  if (sysfs_text("/sys/devices/system/node/online", 0, text, sizeof(text)) && cpu_list(text, &nodes))
+  {
+    for (node = 0; node < CPU_SETSIZE; node++)
+    {
+      if (!CPU_ISSET(node, &nodes) || !sysfs_text("/sys/devices/system/node/node%d/cpulist", node, text, sizeof(text)) || !cpu_list(text, &members))
+        continue;
+      for (i = 0; i < count; i++)
+      {
+        if (CPU_ISSET(info[i].cpu, &members))
+          info[i].node = node;
+      }
+    }
+  }
+  qsort(info, count, sizeof(struct cpu_info), cpu_compact_order);
+  for (i = 0; i < count; i++)
+  {
+    bool package = i > 0 && info[i].package == info[i - 1].package;
+    bool core = package && info[i].core == info[i - 1].core;
+    info[i].thread = core ? info[i - 1].thread + 1 : 0;
+    info[i].rank = !package ? 0 : core ? info[i - 1].rank : info[i - 1].rank + 1;
+    topology.compact[i] = info[i].cpu;
+    topology.node_of[info[i].cpu] = info[i].node;
+    if (i == 0 || info[i].node != info[i - 1].node)
+      topology.nodes[topology.node_count++] = info[i].node;
+  }
+  qsort(info, count, sizeof(struct cpu_info), cpu_spread_order);
+  for (i = 0; i < count; i++)
+    topology.spread[i] = info[i].cpu;
+  topology.cpu_count = count;
+}
+// Function to put the CPUs of node that the shell may use in cpus
+static void topology_node(int node, cpu_set_t *cpus)
+{
+  int i;
+  CPU_ZERO(cpus);
+  for (i = 0; i < topology.cpu_count; i++)
+  {
+    if (topology.node_of[topology.compact[i]] == node)
+      CPU_SET(topology.compact[i], cpus);
+  }
+}
+/*
+job: the command's index in its '&' group
+process: the process's index among those launched for the group, pipeline stages included
+placement: receives where it goes under --affinity
+Returns false with no policy, or no topology to place it with
+*/
+static bool affinity_place(int job, int process, struct placement *placement)
+{
+  if (options.affinity == AFFINITY_OFF)
+    return false;
+  if (!topology.loaded)
+    topology_load();
+  if (topology.cpu_count == 0)
+    return false;
+  placement->node = -1;
+  if (options.affinity == AFFINITY_NUMA)
+  {
+    // A pipeline stays on its command's node, close to the memory its stages share
+    int node = topology.nodes[job % topology.node_count];
+    topology_node(node, &placement->cpus);
+    if (topology.node_count > 1)
+      placement->node = node;
+    return true;
+  }
+  CPU_ZERO(&placement->cpus);
+  CPU_SET((options.affinity == AFFINITY_SPREAD ? topology.spread : topology.compact)[process % topology.cpu_count], &placement->cpus);
+  return true;
+}
+/*
+text: the first argument of an 'affinity' prefix: a CPU list like "0-3,8", or node:N
+placement: receives the CPUs, and the node whose memory to prefer for node:N
+Returns false if it names nothing the shell can run on
+*/
+static bool affinity_parse(const char *text, struct placement *placement)
+{
+  placement->node = -1;
+  if (strncmp(text, "node:", 5) != 0)
+    return cpu_list(text, &placement->cpus);
+  char *end;
+  long node = strtol(text + 5, &end, 10);
+  if (end == text + 5 || *end != '\0' || node < 0 || node >= CPU_SETSIZE)
+    return false;
+  if (!topology.loaded)
+    topology_load();
+  topology_node(node, &placement->cpus);
+  placement->node = node;
+  return CPU_COUNT(&placement->cpus) > 0;
+}
+/*
+mode, mask: a memory policy as get_mempolicy returns it, flags included
+saved: it was read, there is something to put back
+*/
+struct memory_policy
+{
+  int mode;
+  unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+  bool saved;
+};
+/*
+node: NUMA node whose memory the calling thread should prefer; children inherit it
+saved: receives the policy it replaces, NULL in a child that execs next
+*/
+static void placement_memory(int node, struct memory_policy *saved)
+{
+  unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+  if (saved != NULL)
+    saved->saved = syscall(SYS_get_mempolicy, &saved->mode, saved->mask, CPU_SETSIZE + 1, NULL, 0) == 0;
+  mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, CPU_SETSIZE + 1); // ENOSYS without NUMA, nothing to prefer then
+}
+// Function to put back the policy placement_memory replaced, whatever the program had set
+static void placement_restore(const struct memory_policy *saved)
+{
+  if (saved->saved)
+    syscall(SYS_set_mempolicy, saved->mode, saved->mask, CPU_SETSIZE + 1);
+}
+/*
+executable: resolved by the parent
+args: Stack allocated arguments
+fds: what becomes the command's stdin, stdout and stderr, -1 to inherit the shell's; they
+are dup2'd in that order, so STDOUT_FILENO in fds[2] means the command's new stdout
+Returns 0 or the errno of the failed launch
+*/
+static int spawn_command(char *executable, char **args, int fds[3], pid_t *pid)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_t *file_actions = NULL;
+  int i;
+  // Pipe ends and redirect targets are O_CLOEXEC, only the dup2'd copies survive the exec
+  for (i = 0; i < 3; i++)
+  {
+    if (fds[i] < 0)
+      continue;
+    if (file_actions == NULL)
+    {
+      posix_spawn_file_actions_init(&actions);
+      file_actions = &actions;
+    }
+    posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+  }
+  int rc = own_reserve() ? posix_spawn(pid, executable, file_actions, events.epoll_fd >= 0 ? &spawn_attr : NULL, args, environ) : ENOMEM;
+  if (file_actions != NULL)
+  {
+    posix_spawn_file_actions_destroy(file_actions);
+  }
+  if (rc == 0)
+    own.pids[own.count++] = *pid;
+  return rc;
+}
+/*
+executable, args, fds: see spawn_command
+placement: where the command runs, NULL to leave it
+posix_spawn returns once the child has exec'd, too late to move it: the shell moves itself
+instead, the child inherits its CPUs and memory policy, and the shell moves back
+Returns 0 or the errno of the failed launch
+*/
+static int spawn_placed(char *executable, char **args, int fds[3], const struct placement *placement, pid_t *pid)
+{
+  if (placement == NULL)
+    return spawn_command(executable, args, fds, pid);
+  cpu_set_t shell_cpus;
+  struct memory_policy shell_memory;
+  bool moved = sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) == 0 && sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus) == 0;
+  if (placement->node >= 0)
+    placement_memory(placement->node, &shell_memory);
+  int rc = spawn_command(executable, args, fds, pid);
+  if (placement->node >= 0)
+    placement_restore(&shell_memory);
+  if (moved)
+    sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus); // This thread only, the --read-ahead parser never moved
+  return rc;
+}
+/*
+executable: resolved by the parent
+args: Stack allocated arguments
+fds: see spawn_command
+placement: where to move the child before it execs, NULL to leave it
+Returns 0 or the errno of the failed fork
+*/
+static int fork_command(char *executable, char **args, int fds[3], const struct placement *placement, pid_t *pid)
+{
+  if (!own_reserve())
+    return ENOMEM;
+  pid_t rc = fork();
+  if (rc < 0)
+  {
+    return errno;
+  }
+  else if (rc == 0)
+  {
+    trace_after_fork();
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL); // The shell's blocked SIGCHLD isn't the command's
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+      if (fds[i] >= 0)
+        dup2(fds[i], i); // Files were opened by the parent, nothing can fail here
+    }
+    if (placement != NULL)
+    {
+      sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus);
+      if (placement->node >= 0)
+        placement_memory(placement->node, NULL);
+    }
+    TRACE('i', "exec", args[0]);
+    trace_flush(); // Nothing runs after a successful execv
+    execv(executable, args);
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    _exit(1);
+  }
+  own.pids[own.count++] = rc;
+  *pid = rc;
+  return 0;
+}
+/*
+pid: the zygote, a child of the shell
+fd: the shell's end of its socket
+*/
+struct zygote
+{
+  pid_t pid;
+  int fd;
+};
+/*
+maker: socket to the process that forks zygotes, -1 until the first prefork launch
+failed: starting it failed, or this is a -j worker; posix_spawn is used instead
+pool, idle: zygotes ready for a command
+asked: zygotes requested from the maker that haven't arrived yet
+target: pool size aimed for, doubles after a window with misses, shrinks to what it used
+launches, misses, low: over the current window, low being the smallest idle count seen
+cwd: O_PATH descriptor of the shell's directory, sent with every command; -1 after cd
+*/
+struct prefork
+{
+  int maker;
+  bool failed;
+  struct zygote pool[PREFORK_MAX];
+  int idle;
+  int asked;
+  int target;
+  int launches;
+  int misses;
+  int low;
+  int cwd;
+};
+static struct prefork prefork = {-1, false, {{0, 0}}, 0, 0, 1, 0, 0, PREFORK_MAX, -1};
+/*
+slots: for each of stdin, stdout, stderr: which descriptor, -1 for the new stdout
+placed, cpus, node: where the zygote moves before it execs, when placed; node -1 leaves its
+memory policy alone
+The path and the arguments follow, each NUL terminated
+*/
+struct zygote_header
+{
+  int slots[3];
+  bool placed;
+  cpu_set_t cpus;
+  int node;
+};
+/*
+fd: zygote's end of its socket
+Waits for a command, then puts the descriptors in place and execs it; nothing of the shell
+runs in between, the fork happened long before
+*/
+static void zygote_run(int fd)
+{
+  static char message[PREFORK_MESSAGE];
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  struct iovec iov = {message, sizeof(message) - 1};
+  struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+  ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (len <= (ssize_t)sizeof(struct zygote_header) || cmsg == NULL || cmsg->cmsg_len != CMSG_LEN(4 * sizeof(int)))
+    _exit(0); // The shell is gone, or retired this zygote
+  int fds[4];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  struct zygote_header header;
+  memcpy(&header, message, sizeof(header));
+  message[len] = '\0';
+  static char *args[PREFORK_MESSAGE / 2 + 1]; // Every argument takes at least two bytes
+  char *p = message + sizeof(header);
+  char *executable = p;
+  int argc = 0;
+  for (p += strlen(p) + 1; p < message + len; p += strlen(p) + 1)
+    args[argc++] = p;
+  args[argc] = NULL;
+  fchdir(fds[3]);
+  int i;
+  for (i = 0; i < 3; i++)
+    dup2(header.slots[i] < 0 ? STDOUT_FILENO : fds[header.slots[i]], i);
+  if (header.placed)
+    sched_setaffinity(0, sizeof(header.cpus), &header.cpus);
+  if (header.placed && header.node >= 0)
+    placement_memory(header.node, NULL); // Kept across the execv, like a forked command's
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL); // The shell's blocked SIGCHLD isn't the command's
+  execv(executable, args);
+  write(STDERR_FILENO, error_message, strlen(error_message));
+  _exit(1);
+}
+/*
+fd: the maker's socket to the shell
+Forks as many zygotes as each request asks for and hands them over with their sockets.
+CLONE_PARENT makes them children of the shell, so it reaps them like any other command
+*/
+static void prefork_maker(int fd)
+{
+  unsigned char count;
+  while (read(fd, &count, 1) == 1)
+  {
+    for (; count > 0; count--)
+    {
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+        _exit(1);
+      pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+      if (pid == 0)
+      {
+        close(fd);
+        close(sv[0]);
+        zygote_run(sv[1]);
+      }
+      char control[CMSG_SPACE(sizeof(int))];
+      struct iovec iov = {&pid, sizeof(pid)};
+      struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &sv[0], sizeof(int));
+      if (pid < 0 || sendmsg(fd, &msg, 0) < 0)
+        _exit(1);
+      close(sv[0]);
+      close(sv[1]);
+    }
+  }
+  _exit(0); // The shell closed its end
+}
+// Function to start the zygote maker, forked once and stripped of every descriptor but its socket
+static bool prefork_start(void)
+{
+  int sv[2];
+  if (!own_reserve() || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+    return false;
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    trace_after_fork();
+    tracer.fd = -1; // Zygotes don't trace, their exec shows as the parent's prefork event
+    dup2(sv[1], 3); // Whatever the shell had open, pipes of the current line included, must go
+    syscall(SYS_close_range, 4, ~0U, 0);
+    prefork_maker(3);
+  }
+  close(sv[1]);
+  if (pid < 0)
+  {
+    close(sv[0]);
+    return false;
+  }
+  own.pids[own.count++] = pid; // Reaped like any child should it die
+  prefork.maker = sv[0];
+  return true;
+}
+// Function to ask the maker for enough zygotes to bring the pool back to its target
+static void prefork_refill(void)
+{
+  int missing = prefork.target - prefork.idle - prefork.asked;
+  unsigned char count = missing;
+  if (missing > 0 && send(prefork.maker, &count, 1, MSG_DONTWAIT) == 1)
+    prefork.asked += missing;
+}
+// Function to take in the zygotes that have arrived, never blocks
+static void prefork_collect(void)
+{
+  while (prefork.asked > 0 && own_reserve()) // Without room it waits in the socket
+  {
+    pid_t pid;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&pid, sizeof(pid)};
+    struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+    ssize_t got = recvmsg(prefork.maker, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (got == 0)
+      prefork.asked = 0; // The maker died, the pool dries up and posix_spawn takes over
+    if (got != sizeof(pid))
+      return;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+      return;
+    prefork.asked--;
+    own.pids[own.count++] = pid; // A child of the shell from now on, through CLONE_PARENT
+    memcpy(&prefork.pool[prefork.idle].fd, CMSG_DATA(cmsg), sizeof(int));
+    prefork.pool[prefork.idle++].pid = pid;
+  }
+}
+// Function to follow the command rate: a window with misses doubles the pool, one without shrinks it to what was used
+static void prefork_adapt(void)
+{
+  if (++prefork.launches < PREFORK_WINDOW)
+    return;
+  if (prefork.misses > 0)
+  {
+    prefork.target = prefork.target * 2 > PREFORK_MAX ? PREFORK_MAX : prefork.target * 2;
+  }
+  else if (prefork.low > 1)
+  {
+    prefork.target -= prefork.low - 1; // Never went below low, one spare is enough
+    while (prefork.idle > prefork.target)
+    {
+      close(prefork.pool[--prefork.idle].fd); // EOF: the zygote exits and is reaped as a stray
+    }
+  }
+  prefork.launches = prefork.misses = 0;
+  prefork.low = PREFORK_MAX;
+}
+/*
+executable: resolved by the parent
+args: Stack allocated arguments
+fds: see spawn_command
+placement: where the zygote moves before it execs, NULL to leave it
+Returns 0 once a zygote has the command, or the errno of a posix_spawn when none was ready;
+like fork_command, a failed execv is reported by the child
+*/
+static int prefork_command(char *executable, char **args, int fds[3], const struct placement *placement, pid_t *pid)
+{
+  if (prefork.maker < 0 && (prefork.failed || !(prefork.failed = !prefork_start())))
+    return spawn_placed(executable, args, fds, placement, pid);
+  prefork_collect();
+  if (prefork.idle < prefork.low)
+    prefork.low = prefork.idle;
+  char message[PREFORK_MESSAGE];
+  struct zygote_header header;
+  int passed[4];
+  size_t len = sizeof(header);
+  int i;
+  for (i = 0; i < 3; i++)
+  {
+    header.slots[i] = i;
+    passed[i] = fds[i] >= 0 ? fds[i] : i; // Always sent, -j workers and builtins move the shell's own
+  }
+  if (fds[2] == STDOUT_FILENO)
+    header.slots[2] = -1; // '2>&1' follows the command's stdout, not the shell's
+  header.placed = placement != NULL;
+  if (header.placed)
+  {
+    header.cpus = placement->cpus;
+    header.node = placement->node;
+  }
+  if (prefork.cwd < 0)
+    prefork.cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  passed[3] = prefork.cwd;
+  memcpy(message, &header, sizeof(header));
+  bool fits = true;
+  const char *text = executable;
+  for (i = 0; text != NULL && fits; text = args[i++])
+  {
+    size_t size = strlen(text) + 1;
+    fits = size < sizeof(message) - len; // The zygote needs one byte more for its terminator
+    if (fits)
+      memcpy(message + len, text, size);
+    len += size;
+  }
+  if (prefork.idle == 0 || !fits || passed[3] < 0)
+  {
+    prefork.misses += prefork.idle == 0;
+    prefork_adapt();
+    prefork_refill();
+    return spawn_placed(executable, args, fds, placement, pid);
+  }
+  struct zygote zygote = prefork.pool[--prefork.idle];
+  char control[CMSG_SPACE(sizeof(passed))];
+  struct iovec iov = {message, len};
+  struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(passed));
+  memcpy(CMSG_DATA(cmsg), passed, sizeof(passed));
+  ssize_t sent = sendmsg(zygote.fd, &msg, MSG_NOSIGNAL);
+  close(zygote.fd); // The zygote has everything, or exits on EOF
+  prefork_adapt();
+  prefork_refill();
+  if (sent < 0)
+    return spawn_placed(executable, args, fds, placement, pid);
+  *pid = zygote.pid;
+  return 0;
+}
+// Function to drop the parent's zygotes in a -j worker, they are not its children to reap
+static void prefork_after_fork(void)
+{
+  if (prefork.maker >= 0)
+    close(prefork.maker);
+  while (prefork.idle > 0)
+    close(prefork.pool[--prefork.idle].fd);
+  if (prefork.cwd >= 0)
+    close(prefork.cwd);
+  prefork.maker = prefork.cwd = -1;
+  prefork.asked = 0;
+  prefork.failed = true; // A worker lives for one line, a pool of its own would never pay off
+}
+/*
+args: Stack allocated arguments
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+fds: see spawn_command
+resolved: where the command was found ahead of time, or NULL; tried first, a stale one is
+looked up again like a stale cache entry
+placement: CPUs and NUMA node for the command, NULL to let the kernel place it
+Returns the child's pid, or -1 after reporting the error
+*/
+static pid_t execute_command(char **args, char *paths[], size_t *path_counter, int fds[3], char *resolved, const struct placement *placement)
+{
+  int attempt = 0;
+  for (; attempt < 2; attempt++)
+  {
+    // Resolve in the parent so the cache survives and the child only has to exec
+    char *executable = resolved;
+    if (attempt > 0 || executable == NULL)
+    {
+      TRACE('B', "lookup", args[0]);
+      executable = find_executable(args[0], paths, path_counter);
+      TRACE('E', "lookup", args[0]);
+    }
+    if (executable == NULL)
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      return -1;
+    }
+    pid_t pid = -1;
+    int rc;
+    if (options.launch == LAUNCH_FORK)
+    {
+      TRACE('B', "fork", args[0]);
+      rc = fork_command(executable, args, fds, placement, &pid);
+      TRACE('E', "fork", args[0]);
+    }
+    else if (options.launch == LAUNCH_PREFORK)
+    {
+      TRACE('B', "prefork", args[0]);
+      rc = prefork_command(executable, args, fds, placement, &pid);
+      TRACE('E', "prefork", args[0]);
+    }
+    else
+    {
+      TRACE('B', "spawn", args[0]); // posix_spawn returns once the child has exec'd, so the end is the exec as well
+      rc = spawn_placed(executable, args, fds, placement, &pid);
+      TRACE('E', "spawn", args[0]);
+    }
+    if (rc == 0)
+    {
+      return pid;
+    }
+    if (rc != ENOENT || attempt > 0 || access(executable, X_OK) == 0)
+    {
+      break; // Something else is missing, looking the command up again won't help
+    }
+    hash_remove(args[0]); // The cached location vanished before the mtime check caught it, look again
+  }
+  write(STDERR_FILENO, error_message, strlen(error_message));
+  return -1;
+}
+/*
+REDIRECT_OUTPUT: '>' file, stdout and stderr both go to the truncated file, unless the
+command also redirects stderr itself
+REDIRECT_APPEND: '>>' file, the same but appending
+REDIRECT_ERROR: '2>' file, stderr alone to the truncated file
+REDIRECT_ERROR_TO_OUTPUT: '2>&1', stderr goes wherever stdout goes, the pipe included
+REDIRECT_INPUT: '<' file, stdin read from the file
+REDIRECT_TEE: '|>' file, stdout goes to the truncated file and still where it went before,
+the next stage included; stderr stays put
+*/
+enum redirect_kind
+{
+  REDIRECT_OUTPUT,
+  REDIRECT_APPEND,
+  REDIRECT_ERROR,
+  REDIRECT_ERROR_TO_OUTPUT,
+  REDIRECT_INPUT,
+  REDIRECT_TEE
+};
+/*
+kind: which operator
+target: the file name, NULL for '2>&1'
+position: offset of the operator in the line, for error messages
+*/
+struct redirect
+{
+  enum redirect_kind kind;
+  char *target;
+  size_t position;
+};
+/*
+args: command + arguments, NULL terminated, pointing into the line
+args_count: number of args
+redirects: redirections in the order they were written
+redirect_count: number of redirects
+executable: resolved ahead of time by the --read-ahead parser, NULL to look it up at launch
+*/
+struct stage
+{
+  char **args;
+  int args_count;
+  struct redirect *redirects;
+  int redirect_count;
+  char *executable;
+};
+/*
+stages: the '|' pipeline, stdout of each feeds stdin of the next
+stage_count: number of stages
+*/
+struct command
+{
+  struct stage *stages;
+  int stage_count;
+};
+/*
+commands: the '&' separated pipelines, run side by side
+command_count: number of commands
+background: ended in '&', the interactive shell doesn't wait for it
+*/
+struct group
+{
+  struct command *commands;
+  int command_count;
+  bool background;
+};
+/*
+groups: the ';' separated parallel groups, each one finishes before the next starts
+group_count: number of groups
+*/
+struct line_ast
+{
+  struct group *groups;
+  int group_count;
+};
+/*
+position: offset in the line where parsing stopped
+message: what was wrong there
+*/
+struct parse_error
+{
+  size_t position;
+  const char *message;
+};
+/*
+id: the number shown as [id], 0 for a free slot
+pids: every stage of the pipeline, 0 once reaped
+pid_count: number of stages
+alive: stages still running
+status: as for a foreground job
+text: the command as written, cut at STATS_TEXT
+*/
+struct background_job
+{
+  int id;
+  pid_t *pids;
+  int pid_count;
+  int alive;
+  int status;
+  char text[STATS_TEXT];
+};
+static struct background_job background[MAX_BACKGROUND];
+// What an epoll entry carrying a stream points to, the first member of both kinds
+enum stream_kind
+{
+  STREAM_CAPTURE,
+  STREAM_TEE
+};
+/*
+kind: STREAM_CAPTURE
+capture: the group it belongs to
+command: index of the '&' command in the group
+target: STDOUT_FILENO or STDERR_FILENO of the shell
+fd: read end of the pipe, -1 once it reached EOF or was never opened
+data, len, size: what arrived but can't be written yet, malloc'd
+spill: temp file holding it once it outgrew CAPTURE_SPILL, -1 until then
+slot: io_uring buffer it is read into, -1 when epoll drives it
+written, write_len: progress of the io_uring write in flight from that buffer
+*/
+struct capture_stream
+{
+  enum stream_kind kind;
+  struct capture *capture;
+  int command;
+  int target;
+  int fd;
+  char *data;
+  size_t len;
+  size_t size;
+  int spill;
+  int slot;
+  size_t written;
+  size_t write_len;
+};
+/*
+streams: stdout and stderr of every command, 2 * command_count
+command_count: number of '&' commands in the group
+next: in ordered mode, the command allowed to write straight through
+*/
+struct capture
+{
+  struct capture_stream *streams;
+  int command_count;
+  int next;
+};
+/*
+fd: the ring, -1 when io_uring isn't used (--io=epoll, or the kernel refused it)
+sq_*, cq_*: the shared submission and completion rings, see io_uring_setup(2)
+sqes: submission entries
+pending: entries queued since the last io_uring_enter, all submitted with one call
+fixed: the buffers are registered, so reads and writes use the _FIXED ops
+buffers: URING_BUFFERS buffers of URING_BUFFER bytes, one per stream being read
+owner: the capture stream using each buffer, NULL when free
+*/
+struct uring
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned pending;
+  bool fixed;
+  char *buffers;
+  struct capture_stream *owner[URING_BUFFERS];
+};
+static struct uring uring = {.fd = -1};
+// Function to set up the ring and its buffers, leaves uring.fd at -1 if the kernel won't
+static void uring_init(void)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URING_BUFFERS * 2, &params);
+  if (fd < 0)
+    return; // ENOSYS, or disabled by io_uring_disabled / seccomp
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_size > sq_size)
+    sq_size = cq_size;
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  char *buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || buffers == MAP_FAILED)
+  {
+    close(fd); // The mappings that did succeed stay, this only happens once
+    return;
+  }
+  uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+  uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  uring.sq_entries = params.sq_entries;
+  uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  uring.sqes = sqes;
+  uring.buffers = buffers;
+  uring.pending = 0;
+  memset(uring.owner, 0, sizeof(uring.owner));
+  struct iovec iov[URING_BUFFERS];
+  int i;
+  for (i = 0; i < URING_BUFFERS; i++)
+  {
+    iov[i].iov_base = buffers + i * URING_BUFFER;
+    iov[i].iov_len = URING_BUFFER;
+  }
+  // Pinned once instead of on every operation; RLIMIT_MEMLOCK may say no, plain ops work then
+  uring.fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+  uring.fd = fd;
+}
+// Function to hand every queued entry to the kernel in one io_uring_enter
+static void uring_submit(void)
+{
+  while (uring.pending > 0)
+  {
+    int submitted = syscall(__NR_io_uring_enter, uring.fd, uring.pending, 0, 0, NULL, 0);
+    if (submitted < 0 && errno == EINTR)
+      continue;
+    if (submitted <= 0)
+      break;
+    uring.pending -= submitted;
+  }
+}
+/*
+op: IORING_OP_READ or IORING_OP_WRITE, turned into the _FIXED op when the buffers are registered
+fd: pipe to read or file to write
+slot: buffer to use, also what the completion is matched by
+offset, len: part of the buffer
+*/
+static void uring_queue(int op, int fd, int slot, size_t offset, size_t len)
+{
+  unsigned tail = *uring.sq_tail;
+  if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries)
+    uring_submit(); // Can't happen with one operation per slot, but never overwrite an entry
+  unsigned index = tail & *uring.sq_mask;
+  struct io_uring_sqe *sqe = &uring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = uring.fixed ? (op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED) : op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)(uring.buffers + slot * URING_BUFFER + offset);
+  sqe->len = len;
+  sqe->off = -1; // Current position: pipes have none, and an O_APPEND file appends anyway
+  sqe->buf_index = slot;
+  sqe->user_data = (unsigned long)slot << 1 | (op == IORING_OP_WRITE);
+  uring.sq_array[index] = index;
+  __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring.pending++;
+}
+// Function to write a whole buffer, going around short writes
+static void write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write(fd, data, len);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return; // Nowhere to put it, drop the rest like a closed terminal would
+    data += written;
+    len -= written;
+  }
+}
+/*
+stream: a captured stream whose data has to wait
+data, len: what to add
+Keeps it in memory up to CAPTURE_SPILL, then moves everything to an unlinked temp file
+*/
+static void capture_keep(struct capture_stream *stream, const char *data, size_t len)
+{
+  if (stream->spill < 0 && stream->len + len > CAPTURE_SPILL)
+  {
+    stream->spill = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (stream->spill < 0)
+    {
+      char name[] = "/tmp/wish-capture-XXXXXX"; // No O_TMPFILE on this filesystem
+      stream->spill = mkostemp(name, O_CLOEXEC);
+      if (stream->spill >= 0)
+        unlink(name);
+    }
+    if (stream->spill >= 0)
+    {
+      write_all(stream->spill, stream->data, stream->len);
+      free(stream->data);
+      stream->data = NULL;
+      stream->len = stream->size = 0;
+    }
+  }
+  if (stream->spill >= 0)
+  {
+    write_all(stream->spill, data, len);
+    return;
+  }
+  if (stream->len + len > stream->size)
+  {
+    size_t size = stream->size > 0 ? stream->size : 4096;
+    while (size < stream->len + len)
+      size *= 2;
+    char *grown = realloc(stream->data, size);
+    if (grown == NULL)
+    {
+      write_all(stream->target, data, len); // Out of memory: out of order beats lost
+      return;
+    }
+    stream->data = grown;
+    stream->size = size;
+  }
+  memcpy(stream->data + stream->len, data, len);
+  stream->len += len;
+}
+// Function to write out everything a stream kept and free it
+static void capture_release(struct capture_stream *stream)
+{
+  if (stream->spill >= 0)
+  {
+    off_t size = lseek(stream->spill, 0, SEEK_CUR);
+    off_t offset = 0;
+    while (offset < size && sendfile(stream->target, stream->spill, &offset, size - offset) > 0)
+      ;
+    close(stream->spill);
+    stream->spill = -1;
+  }
+  write_all(stream->target, stream->data, stream->len);
+  free(stream->data);
+  stream->data = NULL;
+  stream->len = stream->size = 0;
+}
+/*
+stream: where the data came from
+data, len: what was read, len 0 at EOF
+Ordered: only the command at the head writes through, the others keep theirs until it is
+their turn. Prefix: complete lines go out at once as "[N] line", the last partial line waits.
+*/
+static void capture_data(struct capture_stream *stream, const char *data, size_t len)
+{
+  if (options.capture == CAPTURE_ORDERED)
+  {
+    if (stream->command == stream->capture->next)
+      write_all(stream->target, data, len);
+    else
+      capture_keep(stream, data, len);
+    return;
+  }
+  char prefix[16];
+  int prefix_len = snprintf(prefix, sizeof(prefix), "[%d] ", stream->command + 1);
+  // Everything the chunk completes goes out in one write(): lines stay whole, since only
+  // the shell writes captured output, and there is one syscall per chunk, not per line
+  size_t lines = 1; // Room for an unterminated end too
+  const char *p = data;
+  while (p != NULL && (p = memchr(p, '\n', data + len - p)) != NULL)
+  {
+    lines++;
+    p++;
+  }
+  const char *last = len > 0 ? memrchr(data, '\n', len) : NULL;
+  size_t rest = last != NULL ? (size_t)(data + len - last) - 1 : len; // After the last newline
+  if (len > 0 && rest > 0 && stream->len + rest <= CAPTURE_SPILL && (last != NULL || stream->len + len <= CAPTURE_SPILL))
+  {
+    len -= rest; // Wait for the rest of that line
+  }
+  else
+  {
+    rest = 0; // EOF, or a line too long to hold: it goes out now, given a newline
+  }
+  if (len > 0 || stream->len > 0)
+  {
+    char *out = malloc(stream->len + len + lines * (prefix_len + 1));
+    if (out == NULL)
+      return;
+    size_t used = 0;
+    bool kept = stream->len > 0;
+    while (len > 0 || kept)
+    {
+      const char *newline = len > 0 ? memchr(data, '\n', len) : NULL;
+      size_t take = newline != NULL ? (size_t)(newline - data) + 1 : len;
+      memcpy(out + used, prefix, prefix_len);
+      used += prefix_len;
+      if (kept)
+      {
+        memcpy(out + used, stream->data, stream->len); // The start of this line came earlier
+        used += stream->len;
+        stream->len = 0;
+        kept = false;
+      }
+      memcpy(out + used, data, take);
+      used += take;
+      if (out[used - 1] != '\n')
+        out[used++] = '\n';
+      data += take;
+      len -= take;
+    }
+    write_all(stream->target, out, used);
+    free(out);
+  }
+  if (rest > 0)
+    capture_keep(stream, data, rest);
+}
+// Function to close a stream's pipe and, in ordered mode, let the next commands through
+static void capture_eof(struct capture_stream *stream)
+{
+  struct capture *capture = stream->capture;
+  if (stream->slot < 0)
+    epoll_ctl(events.epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+  close(stream->fd);
+  stream->fd = -1;
+  if (options.capture == CAPTURE_PREFIX)
+  {
+    capture_data(stream, NULL, 0); // The last line, even without its newline
+    free(stream->data);
+    stream->data = NULL;
+    stream->size = 0;
+    return;
+  }
+  while (capture->next < capture->command_count && capture->streams[2 * capture->next].fd < 0 && capture->streams[2 * capture->next + 1].fd < 0)
+  {
+    capture->next++; // Done, hand the output over to the next command
+    if (capture->next < capture->command_count)
+    {
+      capture_release(&capture->streams[2 * capture->next]);
+      capture_release(&capture->streams[2 * capture->next + 1]);
+    }
+  }
+}
+// Function to take what is in a stream's pipe, called from the event loop
+static void capture_read(struct capture_stream *stream)
+{
+  char chunk[65536];
+  ssize_t got = read(stream->fd, chunk, sizeof(chunk));
+  if (got > 0)
+    capture_data(stream, chunk, got);
+  else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+    capture_eof(stream);
+}
+/*
+stream: a capture stream that was just given a pipe
+Returns true if io_uring reads it, false if it has to go through epoll
+*/
+static bool uring_attach(struct capture_stream *stream)
+{
+  int slot;
+  if (uring.fd < 0)
+    return false;
+  for (slot = 0; slot < URING_BUFFERS && uring.owner[slot] != NULL; slot++)
+    ;
+  if (slot == URING_BUFFERS)
+    return false; // More pipes than buffers, the rest use epoll
+  uring.owner[slot] = stream;
+  stream->slot = slot;
+  uring_queue(IORING_OP_READ, stream->fd, slot, 0, URING_BUFFER);
+  return true;
+}
+/*
+Handles every completion: data read at the head of an ordered group is written straight
+back out of the same buffer, anything else is handed to capture_data, and the next read is
+queued; all of it is submitted together before the shell sleeps again
+*/
+static void uring_complete(void)
+{
+  unsigned head = *uring.cq_head;
+  while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+    int slot = cqe->user_data >> 1;
+    bool write_done = cqe->user_data & 1;
+    int res = cqe->res;
+    head++;
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    struct capture_stream *stream = uring.owner[slot];
+    if (write_done)
+    {
+      if (res > 0 && stream->written + res < stream->write_len)
+      {
+        stream->written += res;
+        uring_queue(IORING_OP_WRITE, stream->target, slot, stream->written, stream->write_len - stream->written);
+        continue;
+      }
+      uring_queue(IORING_OP_READ, stream->fd, slot, 0, URING_BUFFER); // Written, or nowhere to write: read on
+      continue;
+    }
+    if (res == -EINTR || res == -EAGAIN)
+    {
+      uring_queue(IORING_OP_READ, stream->fd, slot, 0, URING_BUFFER);
+      continue;
+    }
+    if (res <= 0)
+    {
+      uring.owner[slot] = NULL;
+      stream->slot = -1;
+      capture_eof(stream);
+      continue;
+    }
+    if (options.capture == CAPTURE_ORDERED && stream->command == stream->capture->next)
+    {
+      stream->written = 0;
+      stream->write_len = res;
+      uring_queue(IORING_OP_WRITE, stream->target, slot, 0, res);
+      continue;
+    }
+    capture_data(stream, uring.buffers + slot * URING_BUFFER, res);
+    uring_queue(IORING_OP_READ, stream->fd, slot, 0, URING_BUFFER);
+  }
+}
+// Function to block until io_uring has completed something, for draining after the reaping
+static void uring_wait(void)
+{
+  uring_submit();
+  while (syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR)
+    ;
+  uring_complete();
+}
+/*
+command_count: '&' commands in the group
+Returns the group's capture, every stream closed until capture_pipes opens it; NULL if out
+of memory
+*/
+static struct capture *capture_open(int command_count)
+{
+  struct capture *capture = arena_alloc(&line_arena, sizeof(struct capture));
+  if (capture == NULL || (capture->streams = arena_alloc(&line_arena, 2 * command_count * sizeof(struct capture_stream))) == NULL)
+    return NULL; // Not captured then, the commands write where they would anyway
+  capture->command_count = command_count;
+  capture->next = 0;
+  int i;
+  for (i = 0; i < 2 * command_count; i++)
+  {
+    struct capture_stream *stream = &capture->streams[i];
+    memset(stream, 0, sizeof(*stream));
+    stream->capture = capture;
+    stream->command = i / 2;
+    stream->target = i % 2 == 0 ? STDOUT_FILENO : STDERR_FILENO;
+    stream->fd = -1;
+    stream->kind = STREAM_CAPTURE;
+    stream->spill = -1;
+    stream->slot = -1;
+  }
+  return capture;
+}
+/*
+capture: the group's capture
+command: which command is about to be launched
+write_fds: receives the write ends for its stdout and stderr, for the parent to close
+once it is launched
+Returns false if the pipes couldn't be made, the command then writes straight through
+*/
+static bool capture_pipes(struct capture *capture, int command, int write_fds[2])
+{
+  int i;
+  for (i = 0; i < 2; i++)
+  {
+    struct capture_stream *stream = &capture->streams[2 * command + i];
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+      break;
+    stream->fd = pipe_fds[0];
+    write_fds[i] = pipe_fds[1];
+    if (uring_attach(stream))
+      continue; // Blocking reads are fine there, they complete asynchronously
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK); // Drained until EAGAIN, never waited on
+    struct epoll_event event = {EPOLLIN, {.ptr = stream}};
+    if (epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, pipe_fds[0], &event) != 0)
+    {
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      stream->fd = -1;
+      break;
+    }
+  }
+  if (i == 2)
+    return true;
+  if (i == 1)
+  {
+    close(write_fds[0]);
+    capture_eof(&capture->streams[2 * command]);
+  }
+  return false;
+}
+/*
+capture: the group's capture, after every command was reaped
+Takes what is left in the pipes and writes out everything still held
+*/
+static void capture_finish(struct capture *capture)
+{
+  int i;
+  for (i = 0; i < 2 * capture->command_count; i++)
+  {
+    struct capture_stream *stream = &capture->streams[i];
+    while (stream->slot >= 0)
+    {
+      uring_wait(); // Until its read sees EOF
+    }
+    while (stream->fd >= 0)
+    {
+      char chunk[65536];
+      ssize_t got = read(stream->fd, chunk, sizeof(chunk));
+      if (got > 0)
+        capture_data(stream, chunk, got);
+      else if (got < 0 && errno == EINTR)
+        continue;
+      else
+        capture_eof(stream); // EOF, or a leftover background process still has it open
+    }
+  }
+  for (i = 0; i < 2 * capture->command_count; i++)
+  {
+    capture_release(&capture->streams[i]); // Ordered mode already did all but a failed spill
+  }
+}
+/*
+kind: STREAM_TEE, so the event loop tells it from a capture_stream
+fd: read end of the pipe the command writes its stdout to, -1 once closed
+file: the '|>' target, a copy of the group's descriptor
+out: where the command's stdout would have gone otherwise; a pipe is reopened O_NONBLOCK,
+so a next stage that doesn't keep up never stops the shell
+bridge: pipe tee(2) duplicates into when out isn't a pipe, tee(2) only works between pipes
+copy: splice refused one of the ends (a terminal, an O_APPEND file), read()/write() from now on
+blocked: out is full, epoll watches it for EPOLLOUT instead of fd for EPOLLIN
+held, held_len, held_offset: in copy mode, what was read and out hasn't taken yet
+next: the group's other tees
+*/
+struct tee_stream
+{
+  enum stream_kind kind;
+  int fd;
+  int file;
+  int out;
+  int bridge[2];
+  bool copy;
+  bool blocked;
+  char *held;
+  size_t held_len;
+  size_t held_offset;
+  struct tee_stream *next;
+};
+/*
+from, to: descriptors, from holds at least len bytes
+copy: set once splice fails, the rest then goes through a buffer
+*/
+static void tee_pass(int from, int to, size_t len, bool *copy)
+{
+  while (len > 0 && !*copy)
+  {
+    ssize_t moved = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+    if (moved < 0 && errno == EINTR)
+      continue;
+    if (moved <= 0)
+      *copy = true;
+    else
+      len -= moved;
+  }
+  char chunk[65536];
+  while (len > 0)
+  {
+    ssize_t got = read(from, chunk, len < sizeof(chunk) ? len : sizeof(chunk));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return;
+    write_all(to, chunk, got);
+    len -= got;
+  }
+}
+// Function to wait for out to have room rather than for more input, or the other way round
+static void tee_block(struct tee_stream *stream, bool blocked)
+{
+  struct epoll_event input = {blocked ? 0 : EPOLLIN, {.ptr = stream}};
+  struct epoll_event room = {EPOLLOUT, {.ptr = stream}};
+  if (stream->blocked == blocked)
+    return;
+  if (blocked && epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, stream->out, &room) != 0)
+    return; // Not a pipe after all, writes to it simply wait
+  if (!blocked)
+    epoll_ctl(events.epoll_fd, EPOLL_CTL_DEL, stream->out, NULL);
+  epoll_ctl(events.epoll_fd, EPOLL_CTL_MOD, stream->fd, &input);
+  stream->blocked = blocked;
+}
+// Function to hand out what copy mode holds, true once it is all gone
+static bool tee_flush(struct tee_stream *stream)
+{
+  while (stream->held_offset < stream->held_len)
+  {
+    ssize_t written = write(stream->out, stream->held + stream->held_offset, stream->held_len - stream->held_offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0 && errno == EAGAIN)
+    {
+      tee_block(stream, true);
+      return false;
+    }
+    if (written <= 0)
+      break; // Nobody reads it any more, drop it like a closed pipe would
+    stream->held_offset += written;
+  }
+  stream->held_len = stream->held_offset = 0;
+  return true;
+}
+/*
+stream: a tee whose pipe is readable, or whose out has room again
+Duplicates what is in the pipe with tee(2) and splices both copies to their destinations,
+so it never passes through the shell; read()/write() once an end doesn't take splices.
+When out is full it waits for it through epoll instead of in a syscall
+Returns false at EOF
+*/
+static bool tee_move(struct tee_stream *stream)
+{
+  tee_block(stream, false);
+  if (!stream->copy)
+  {
+    int duplicate = stream->bridge[1] >= 0 ? stream->bridge[1] : stream->out;
+    ssize_t len = tee(stream->fd, duplicate, INT_MAX, SPLICE_F_NONBLOCK);
+    if (len < 0 && errno == EINTR)
+      return true;
+    if (len < 0 && errno == EAGAIN)
+    {
+      int pending = 0;
+      if (ioctl(stream->fd, FIONREAD, &pending) == 0 && pending > 0)
+        tee_block(stream, true); // The input is there, the next stage hasn't kept up
+      return true;
+    }
+    if (len == 0)
+      return false;
+    if (len > 0)
+    {
+      // tee(2) left the data in the pipe, splicing it to the file consumes it
+      tee_pass(stream->fd, stream->file, len, &stream->copy);
+      if (stream->bridge[0] >= 0)
+        tee_pass(stream->bridge[0], stream->out, len, &stream->copy);
+      return true;
+    }
+    stream->copy = true;
+  }
+  if (!tee_flush(stream))
+    return true;
+  if (stream->held == NULL && (stream->held = arena_alloc(&line_arena, TEE_CHUNK)) == NULL)
+    return false; // No buffer to copy through, the file gets what it has so far
+  ssize_t got = read(stream->fd, stream->held, TEE_CHUNK);
+  if (got < 0)
+    return errno == EINTR || errno == EAGAIN;
+  if (got == 0)
+    return false;
+  write_all(stream->file, stream->held, got);
+  stream->held_len = got;
+  tee_flush(stream);
+  return true;
+}
+// Function to stop watching a tee and let go of its descriptors
+static void tee_close(struct tee_stream *stream)
+{
+  tee_block(stream, false);
+  epoll_ctl(events.epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+  close(stream->fd);
+  close(stream->file);
+  close(stream->out);
+  if (stream->bridge[0] >= 0)
+  {
+    close(stream->bridge[0]);
+    close(stream->bridge[1]);
+  }
+  stream->fd = -1;
+}
+// Function to move what just arrived in a tee's pipe, called from the event loop
+static void tee_read(struct tee_stream *stream)
+{
+  if (!tee_move(stream))
+    tee_close(stream);
+}
+/*
+file: descriptor of the '|>' target
+out: what the command's stdout would have been
+tees: the group's tees, the new one goes in front
+write_fd: receives the end the command writes to, for the parent to close once it is launched
+Returns false if it couldn't be set up, the command then writes to the file alone
+*/
+static bool tee_open(int file, int out, struct tee_stream **tees, int *write_fd)
+{
+  int pipe_fds[2];
+  if (events.epoll_fd < 0 || pipe2(pipe_fds, O_CLOEXEC) != 0)
+    return false; // Without the event loop nothing would drain it while the command runs
+  struct tee_stream *stream = arena_alloc(&line_arena, sizeof(struct tee_stream));
+  if (stream == NULL)
+  {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return false;
+  }
+  struct stat st;
+  stream->kind = STREAM_TEE;
+  stream->fd = pipe_fds[0]; // Left blocking: only read when epoll says there is something
+  stream->file = fcntl(file, F_DUPFD_CLOEXEC, 3);
+  stream->out = -1;
+  stream->bridge[0] = stream->bridge[1] = -1;
+  stream->copy = stream->blocked = false;
+  stream->held = NULL;
+  stream->held_len = stream->held_offset = 0;
+  if (fstat(out, &st) == 0 && S_ISFIFO(st.st_mode))
+  {
+    // A description of its own: O_NONBLOCK on a shared one would reach whoever else writes to it
+    char name[32];
+    snprintf(name, sizeof(name), "/proc/self/fd/%d", out);
+    stream->out = open(name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  }
+  if (stream->out < 0)
+    stream->out = fcntl(out, F_DUPFD_CLOEXEC, 3);
+  if (!S_ISFIFO(st.st_mode) && pipe2(stream->bridge, O_CLOEXEC) != 0)
+    stream->copy = true;
+  struct epoll_event event = {EPOLLIN, {.ptr = stream}};
+  if (stream->file < 0 || stream->out < 0 || epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, stream->fd, &event) != 0)
+  {
+    close(pipe_fds[1]);
+    tee_close(stream);
+    return false;
+  }
+  stream->next = *tees;
+  *tees = stream;
+  *write_fd = pipe_fds[1];
+  return true;
+}
+/*
+tees: the group's tees, after every command was reaped
+Moves what is left in their pipes
+*/
+static void tee_finish(struct tee_stream *tees)
+{
+  for (; tees != NULL; tees = tees->next)
+  {
+    while (tees->fd >= 0)
+    {
+      int pending = 0;
+      struct pollfd room = {tees->out, POLLOUT, 0};
+      if (tees->blocked)
+        poll(&room, 1, -1); // The commands are gone, only the reader of out is left to wait for
+      // Empty means EOF, or a leftover background process still has it open
+      if (!tees->blocked && tees->held_len == 0 && (ioctl(tees->fd, FIONREAD, &pending) != 0 || pending == 0))
+        tee_close(tees);
+      else
+        tee_read(tees);
+    }
+  }
+}
+// Function to set up SIGCHLD delivery through a signalfd watched by epoll
+static void events_init(void)
+{
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, NULL);
+  events.signal_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  events.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {EPOLLIN, {.ptr = NULL}}; // The other sources carry a pointer
+  if (events.signal_fd < 0 || events.epoll_fd < 0 || epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, events.signal_fd, &event) != 0)
+  {
+    // Old kernel or out of fds: blocking waits still work
+    if (events.signal_fd >= 0)
+      close(events.signal_fd);
+    if (events.epoll_fd >= 0)
+      close(events.epoll_fd);
+    events.signal_fd = events.epoll_fd = -1;
+    sigprocmask(SIG_UNBLOCK, &chld, NULL);
+    return;
+  }
+  // A '|>' whose next stage quit gets EPIPE instead of killing the shell; commands start
+  // with the empty mask below
+  sigset_t broken;
+  sigemptyset(&broken);
+  sigaddset(&broken, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &broken, NULL);
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_init(&spawn_attr);
+  posix_spawnattr_setsigmask(&spawn_attr, &none);
+  posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGMASK);
+  if (options.io == IO_URING)
+  {
+    uring_init();
+    struct epoll_event ring = {EPOLLIN, {.ptr = &uring}}; // Readable while completions are waiting
+    if (uring.fd >= 0 && epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, uring.fd, &ring) != 0)
+    {
+      close(uring.fd);
+      uring.fd = -1;
+    }
+  }
+}
+// Function to give a forked -j worker its own epoll and signalfd, the inherited ones belong to the parent
+static void events_after_fork(void)
+{
+  own.count = 0; // The parent's children, not the worker's to wait for
+  if (events.epoll_fd < 0)
+    return;
+  close(events.epoll_fd);
+  close(events.signal_fd);
+  if (uring.fd >= 0)
+  {
+    close(uring.fd); // The mappings are shared with the parent's ring, a worker gets its own
+    uring.fd = -1;
+  }
+  events.input = false;
+  events_init();
+}
+// Function to also wake up for input at the interactive prompt
+static void events_watch_input(void)
+{
+  struct epoll_event event = {EPOLLIN, {.ptr = &events}};
+  events.input = events.epoll_fd >= 0 && epoll_ctl(events.epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0;
+}
+/*
+Sleeps until a child exits or, when watched, stdin has something; captured output that
+arrives meanwhile is taken care of here
+Returns true if stdin is readable
+*/
+static bool events_wait(void)
+{
+  struct epoll_event ready[16];
+  if (uring.fd >= 0)
+    uring_submit(); // Everything queued since the last sleep, in one call
+  int count = epoll_wait(events.epoll_fd, ready, 16, -1);
+  bool input = false;
+  int i;
+  for (i = 0; i < count; i++)
+  {
+    if (ready[i].data.ptr == NULL)
+    {
+      struct signalfd_siginfo info[8];
+      while (read(events.signal_fd, info, sizeof(info)) > 0)
+        ; // Several exits can share one SIGCHLD, wait4 finds them all
+    }
+    else if (ready[i].data.ptr == &events)
+    {
+      input = true;
+    }
+    else if (ready[i].data.ptr == &uring)
+    {
+      uring_complete();
+    }
+    else if (*(enum stream_kind *)ready[i].data.ptr == STREAM_TEE)
+    {
+      tee_read(ready[i].data.ptr);
+    }
+    else
+    {
+      capture_read(ready[i].data.ptr);
+    }
+  }
+  return input;
+}
+/*
+wstatus, usage: as from wait4
+Returns a child that has exited, or -1 when there are none left
+*/
+static pid_t reap_any(int *wstatus, struct rusage *usage)
+{
+  while (1)
+  {
+    pid_t pid = own_reap(wstatus, usage);
+    if (pid == 0 && events.epoll_fd >= 0)
+    {
+      events_wait(); // Still running, sleep until the next SIGCHLD
+      continue;
+    }
+    if (pid == 0)
+    {
+      // No signalfd: sleep until some child exits, polling every millisecond while one of
+      // the program's own sits there unreaped
+      siginfo_t info;
+      struct timespec tick = {0, 1000000};
+      info.si_pid = 0;
+      if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0)
+        nanosleep(&tick, NULL);
+      else
+        waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);
+      continue;
+    }
+    if (pid > 0 && __builtin_expect(tracer.fd >= 0, 0))
+    {
+      char detail[16];
+      snprintf(detail, sizeof(detail), "%d", (int)pid);
+      trace_event('i', "reap", detail);
+    }
+    return pid;
+  }
+}
+/*
+paths, path_counter: its PATH, /bin to start with like a new shell
+cwd: its working directory, the process moves there while one of its lines runs
+hash: its command cache, swapped into command_hash while it is the active one
+*/
+struct wish
+{
+  char *paths[MAX_PATH];
+  size_t path_counter;
+  int cwd;
+  struct hash_table hash;
+};
+/*
+pid: the process running a wish_start() line
+pidfd: what the caller got for it
+done, status: it was reaped while waiting for something else, the status is kept here
+*/
+struct wish_started
+{
+  pid_t pid;
+  int pidfd;
+  bool done;
+  int status;
+};
+/*
+active: the handle whose cache is in command_hash, NULL for none
+running: a wish_run() line or a batch script is running, exit must not end the process
+exiting: that line called exit
+started, started_count: wish_start() lines not collected by wish_wait() yet
+*/
+struct embedding
+{
+  struct wish *active;
+  bool running;
+  bool exiting;
+  struct wish_started *started;
+  int started_count;
+};
+static struct embedding embedding;
+/*
+pid: a reaped child
+wstatus: its status from wait4
+Returns true if it was running a wish_start() line, wish_wait() hands out the status
+*/
+static bool wish_reaped(pid_t pid, int wstatus)
+{
+  int i;
+  for (i = 0; i < embedding.started_count; i++)
+  {
+    if (embedding.started[i].pid != pid)
+      continue;
+    embedding.started[i].done = true;
+    embedding.started[i].status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    return true;
+  }
+  return false;
+}
+/*
+pid: a reaped child that isn't part of the line being run
+wstatus: its status from wait4
+*/
+static void background_reaped(pid_t pid, int wstatus)
+{
+  int i, st;
+  if (wish_reaped(pid, wstatus))
+    return; // A wish_start() line, wish_wait() reports it
+  for (i = 0; i < MAX_BACKGROUND; i++)
+  {
+    for (st = 0; background[i].id != 0 && st < background[i].pid_count; st++)
+    {
+      if (background[i].pids[st] != pid)
+        continue;
+      background[i].pids[st] = 0;
+      background[i].alive--;
+      if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0)
+        background[i].status = WEXITSTATUS(wstatus);
+      else if (WIFSIGNALED(wstatus))
+        background[i].status = 128 + WTERMSIG(wstatus);
+      return;
+    }
+  }
+}
+// Function to reap background jobs that have already finished, never blocks
+static void background_poll(void)
+{
+  int wstatus;
+  pid_t pid;
+  while ((pid = own_reap(&wstatus, NULL)) > 0)
+  {
+    background_reaped(pid, wstatus);
+  }
+}
+/*
+all: list running jobs as well, for the jobs builtin
+Prints finished jobs once, like an interactive shell does before its prompt, and frees
+their slots
+*/
+static void background_report(bool all)
+{
+  int i;
+  for (i = 0; i < MAX_BACKGROUND; i++)
+  {
+    struct background_job *job = &background[i];
+    if (job->id == 0 || (job->alive > 0 && !all))
+      continue;
+    if (job->alive > 0)
+      fprintf(stderr, "[%d] Running\t%s\n", job->id, job->text);
+    else if (job->status == 0)
+      fprintf(stderr, "[%d] Done\t%s\n", job->id, job->text);
+    else
+      fprintf(stderr, "[%d] Exit %d\t%s\n", job->id, job->status, job->text);
+    if (job->alive == 0)
+    {
+      free(job->pids);
+      job->id = 0;
+    }
+  }
+}
+/*
+id: job to wait for, 0 for all of them
+Returns the status of the job, 0 when waiting for all
+*/
+static int background_wait(int id)
+{
+  int i;
+  for (i = 0; i < MAX_BACKGROUND; i++)
+  {
+    struct background_job *job = &background[i];
+    if (job->id == 0 || (id != 0 && job->id != id))
+      continue;
+    while (job->alive > 0)
+    {
+      int wstatus;
+      struct rusage usage;
+      pid_t pid = reap_any(&wstatus, &usage);
+      if (pid < 0)
+        break; // Nothing left to wait for
+      background_reaped(pid, wstatus);
+    }
+    int status = job->status;
+    free(job->pids); // Waited for, so not reported as done later
+    job->id = 0;
+    if (id != 0)
+      return status;
+  }
+  return id != 0 ? 127 : 0; // No such job
+}
+/*
+dir: the --memo cache directory, -1 when memoization is off
+pure: commands declared pure with the pure builtin, malloc'd names
+pure_count: number of them
+*/
+struct memo
+{
+  int dir;
+  char **pure;
+  size_t pure_count;
+};
+static struct memo memo = {-1, NULL, 0};
+#define BUILTIN_EXTERNAL -1 // Returned by a utility builtin that leaves the arguments to the real program
+/*
+args: the builtin and its arguments
+args_count: number of args
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Returns the exit status, 1 after reporting an error
+*/
+typedef int (*builtin_function)(char **args, int args_count, char *paths[], size_t *path_counter);
+/*
+name: what the command is called
+run: the implementation
+state: changes the shell itself (cwd, PATH, cache), so it always runs here, never in a
+pipeline stage or a -j worker; the others are plain utilities that only spare a fork+exec
+*/
+struct builtin_entry
+{
+  const char *name;
+  builtin_function run;
+  bool state;
+};
+// Function for exit
+static int builtin_exit(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  if (args_count > 1)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  if (embedding.running)
+  {
+    embedding.exiting = true; // Ends the wish_run() caller's session, not the program
+    return 0;
+  }
+  exit(0);
+}
+// Function for cd
+static int builtin_cd(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  if (args_count != 2 || chdir(args[1]) != 0) // Error in changing directory
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  if (prefork.cwd >= 0)
+  {
+    close(prefork.cwd); // Zygotes get the new directory from the next command on
+    prefork.cwd = -1;
+  }
+  size_t i;
+  for (i = 0; i < *path_counter; i++)
+  {
+    if (paths[i][0] != '/')
+    {
+      hash_clear(); // A relative PATH entry now names another directory
+      break;
+    }
+  }
+  return 0;
+}
+// Function for path
+static int builtin_path(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  clear_path(paths, path_counter);
+  hash_clear(); // Every cached location may be shadowed or gone now
+  int i;
+  for (i = 1; i < args_count && *path_counter < MAX_PATH; i++)
+  {
+    paths[(*path_counter)] = strdup(args[i]); // Don't check, that is for find_executable
+    (*path_counter)++;
+  }
+  return 0;
+}
+// Function for hash: list the cache, -r to empty it, or look names up now
+static int builtin_hash(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  if (args_count == 2 && strcmp(args[1], "-r") == 0) // Forget every location
+  {
+    hash_clear();
+    return 0;
+  }
+  if (args_count == 1) // List what is cached
+  {
+    if (command_hash.count == 0)
+    {
+      printf("hash: hash table empty\n");
+      return 0;
+    }
+    printf("hits\tcommand\n");
+    size_t i;
+    for (i = 0; i < command_hash.size; i++)
+    {
+      if (command_hash.entries[i].name != NULL)
+      {
+        printf("%4u\t%s\n", command_hash.entries[i].hits, command_hash.entries[i].full_path);
+      }
+    }
+    return 0;
+  }
+  int i;
+  int status = 0;
+  for (i = 1; i < args_count; i++) // hash name...: look the names up now
+  {
+    char *executable = find_executable(args[i], paths, path_counter);
+    if (executable == NULL)
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      status = 1;
+    }
+  }
+  return status;
+}
+// Function for pure: list the commands --memo may replay, -r to forget them, or add names
+static int builtin_pure(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  size_t i;
+  if (args_count == 1)
+  {
+    for (i = 0; i < memo.pure_count; i++)
+      printf("%s\n", memo.pure[i]);
+    return 0;
+  }
+  if (args_count == 2 && strcmp(args[1], "-r") == 0)
+  {
+    for (i = 0; i < memo.pure_count; i++)
+      free(memo.pure[i]);
+    memo.pure_count = 0;
+    return 0;
+  }
+  char **grown = realloc(memo.pure, (memo.pure_count + args_count - 1) * sizeof(char *));
+  if (grown == NULL)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  memo.pure = grown;
+  int a;
+  for (a = 1; a < args_count; a++)
+  {
+    memo.pure[memo.pure_count++] = strdup(args[a]);
+  }
+  return 0;
+}
+// Function for affinity: show the --affinity policy and the order CPUs or nodes are handed
+// out in, or set it; 'affinity CPUS|node:N command' is a prefix, taken off by run_group
+static int builtin_affinity(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  static const char *policies[] = {[AFFINITY_OFF] = "off", [AFFINITY_SPREAD] = "spread", [AFFINITY_COMPACT] = "compact", [AFFINITY_NUMA] = "numa"};
+  int i;
+  if (args_count == 2)
+  {
+    for (i = 0; i < 4; i++)
+    {
+      if (strcmp(args[1], policies[i]) == 0)
+      {
+        options.affinity = i;
+        return 0;
+      }
+    }
+  }
+  if (args_count != 1)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  printf("%s", policies[options.affinity]);
+  if (options.affinity != AFFINITY_OFF && !topology.loaded)
+    topology_load();
+  int count = options.affinity == AFFINITY_OFF ? 0 : options.affinity == AFFINITY_NUMA ? topology.node_count : topology.cpu_count;
+  const int *order = options.affinity == AFFINITY_NUMA ? topology.nodes : options.affinity == AFFINITY_SPREAD ? topology.spread : topology.compact;
+  for (i = 0; i < count; i++)
+    printf(" %d", order[i]);
+  printf("\n");
+  return 0;
+}
+// Function for wait: every background job, or the one given as %N or N.
+// Foreground children are always reaped before a line returns, and in batch mode with -j
+// it is the barrier between parallel lines.
+static int builtin_wait(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  if (args_count > 2)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  if (args_count == 1)
+    return background_wait(0);
+  int id = atoi(args[1][0] == '%' ? args[1] + 1 : args[1]);
+  if (id <= 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  return background_wait(id);
+}
+// Function for jobs: background jobs still running, and finished ones not reported yet
+static int builtin_jobs(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  background_poll();
+  background_report(true);
+  return 0;
+}
+// Function for true
+static int builtin_true(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  return 0;
+}
+// Function for false
+static int builtin_false(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  return 1;
+}
+// Function for echo, -n only; -e/-E and the rest go to /bin/echo
+static int builtin_echo(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  int i = 1;
+  bool newline = true;
+  for (; i < args_count && args[i][0] == '-' && args[i][1] != '\0'; i++)
+  {
+    if (strspn(args[i] + 1, "n") != strlen(args[i] + 1))
+    {
+      if (strspn(args[i] + 1, "neE") == strlen(args[i] + 1))
+        return BUILTIN_EXTERNAL; // Escapes, leave them to the real echo
+      break; // Not an option, printed like any other word
+    }
+    newline = false;
+  }
+  for (; i < args_count; i++)
+  {
+    fputs(args[i], stdout);
+    if (i < args_count - 1)
+      putchar(' ');
+  }
+  if (newline)
+    putchar('\n');
+  return 0;
+}
+// Function for pwd without options
+static int builtin_pwd(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  char cwd[MAX_PATH_LENGTH];
+  if (args_count > 1 || getcwd(cwd, sizeof(cwd)) == NULL)
+    return BUILTIN_EXTERNAL;
+  puts(cwd);
+  return 0;
+}
+// Function for 'sleep 0', any real sleep is left to /bin/sleep
+static int builtin_sleep(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  char *end;
+  if (args_count != 2 || strtod(args[1], &end) != 0 || end == args[1] || *end != '\0')
+    return BUILTIN_EXTERNAL;
+  return 0;
+}
+/*
+format: printf format
+args: the values, used in order and the format repeated while any are left
+args_count: number of values
+emit: false only checks that everything is understood, without printing
+Returns 0, or BUILTIN_EXTERNAL for a conversion or a number this doesn't handle
+*/
+static int printf_format(const char *format, char **args, int args_count, bool emit)
+{
+  int used = 0;
+  do
+  {
+    const char *p = format;
+    int consumed = used;
+    while (*p != '\0')
+    {
+      if (*p == '\\')
+      {
+        const char *escapes = "\\\\n\nt\tr\ra\ab\bf\fv\v\"\"";
+        const char *e = p[1] != '\0' ? strchr(escapes, p[1]) : NULL;
+        while (e != NULL && (e - escapes) % 2 != 0)
+          e = strchr(e + 1, p[1]);
+        if (e == NULL)
+          return BUILTIN_EXTERNAL; // Octal and friends
+        if (emit)
+          putchar(e[1]);
+        p += 2;
+        continue;
+      }
+      if (*p != '%')
+      {
+        if (emit)
+          putchar(*p);
+        p++;
+        continue;
+      }
+      if (p[1] == '%')
+      {
+        if (emit)
+          putchar('%');
+        p += 2;
+        continue;
+      }
+      // %[flags][width][.precision]conversion, handed to the C library as it is
+      size_t len = 1 + strspn(p + 1, "-+ #0");
+      len += strspn(p + len, "0123456789");
+      if (p[len] == '.')
+        len += 1 + strspn(p + len + 1, "0123456789");
+      char conversion = p[len];
+      if (conversion == '\0' || strchr("sdiuxXoc", conversion) == NULL || len > 16)
+        return BUILTIN_EXTERNAL;
+      char spec[24];
+      memcpy(spec, p, len);
+      const char *value = used < args_count ? args[used] : NULL;
+      used++;
+      if (conversion == 's' || conversion == 'c')
+      {
+        spec[len] = conversion;
+        spec[len + 1] = '\0';
+        if (value == NULL)
+          value = "";
+        if (emit && conversion == 's')
+          printf(spec, value);
+        else if (emit && value[0] != '\0')
+          printf(spec, value[0]);
+      }
+      else
+      {
+        char *end;
+        long long number = 0;
+        if (value != NULL)
+        {
+          errno = 0;
+          number = strtoll(value, &end, 0);
+          if (end == value || *end != '\0' || errno != 0)
+            return BUILTIN_EXTERNAL; // The real printf decides what a bad number prints
+        }
+        memcpy(spec + len, "ll", 2);
+        spec[len + 2] = conversion;
+        spec[len + 3] = '\0';
+        if (emit)
+          printf(spec, number);
+      }
+      p += len + 1;
+    }
+    if (used == consumed)
+      break; // No conversions, the leftover values are ignored
+  } while (used < args_count);
+  return 0;
+}
+// Function for printf, for the common conversions
+static int builtin_printf(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  if (args_count < 2 || args[1][0] == '-')
+    return BUILTIN_EXTERNAL;
+  // Check first so nothing is printed twice when it falls back
+  if (printf_format(args[1], args + 2, args_count - 2, false) != 0)
+    return BUILTIN_EXTERNAL;
+  return printf_format(args[1], args + 2, args_count - 2, true);
+}
+/*
+args: the expression, without 'test' or the closing ']'
+count: number of words
+Returns 0 if true, 1 if false, BUILTIN_EXTERNAL for anything but the common forms
+*/
+static int test_expression(char **args, int count)
+{
+  if (count > 0 && strcmp(args[0], "!") == 0)
+  {
+    int result = test_expression(args + 1, count - 1);
+    return result == BUILTIN_EXTERNAL ? result : !result;
+  }
+  if (count == 0)
+    return 1;
+  if (count == 1)
+    return args[0][0] == '\0';
+  if (count == 2)
+  {
+    const char *op = args[0];
+    struct stat st;
+    if (strcmp(op, "-n") == 0)
+      return args[1][0] == '\0';
+    if (strcmp(op, "-z") == 0)
+      return args[1][0] != '\0';
+    if (strcmp(op, "-r") == 0)
+      return access(args[1], R_OK) != 0;
+    if (strcmp(op, "-w") == 0)
+      return access(args[1], W_OK) != 0;
+    if (strcmp(op, "-x") == 0)
+      return access(args[1], X_OK) != 0;
+    if (strcmp(op, "-e") != 0 && strcmp(op, "-f") != 0 && strcmp(op, "-d") != 0 && strcmp(op, "-s") != 0)
+      return BUILTIN_EXTERNAL;
+    if (stat(args[1], &st) != 0)
+      return 1;
+    if (op[1] == 'f')
+      return !S_ISREG(st.st_mode);
+    if (op[1] == 'd')
+      return !S_ISDIR(st.st_mode);
+    if (op[1] == 's')
+      return st.st_size == 0;
+    return 0;
+  }
+  if (count == 3)
+  {
+    const char *op = args[1];
+    if (strcmp(op, "=") == 0)
+      return strcmp(args[0], args[2]) != 0;
+    if (strcmp(op, "!=") == 0)
+      return strcmp(args[0], args[2]) == 0;
+    const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int i;
+    for (i = 0; i < 6 && strcmp(op, ops[i]) != 0; i++)
+      ;
+    char *end_a, *end_b;
+    errno = 0;
+    long long a = strtoll(args[0], &end_a, 10);
+    long long b = strtoll(args[2], &end_b, 10);
+    if (i == 6 || end_a == args[0] || *end_a != '\0' || end_b == args[2] || *end_b != '\0' || errno != 0)
+      return BUILTIN_EXTERNAL; // Unknown operator, or let the real test complain about the number
+    bool result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+    return !result[i];
+  }
+  return BUILTIN_EXTERNAL; // -a, -o and parentheses
+}
+// Function for test and [
+static int builtin_test(char **args, int args_count, char *paths[], size_t *path_counter)
+{
+  if (strcmp(args[0], "[") == 0)
+  {
+    if (strcmp(args[args_count - 1], "]") != 0)
+      return BUILTIN_EXTERNAL; // Let it report the missing ']'
+    args_count--;
+  }
+  return test_expression(args + 1, args_count - 1);
+}
+// Index of every builtin in builtins[]
+enum builtin_id
+{
+  BUILTIN_EXIT,
+  BUILTIN_CD,
+  BUILTIN_PATH,
+  BUILTIN_HASH,
+  BUILTIN_WAIT,
+  BUILTIN_JOBS,
+  BUILTIN_PURE,
+  BUILTIN_AFFINITY,
+  BUILTIN_ECHO,
+  BUILTIN_TRUE,
+  BUILTIN_FALSE,
+  BUILTIN_PRINTF,
+  BUILTIN_TEST,
+  BUILTIN_BRACKET,
+  BUILTIN_PWD,
+  BUILTIN_SLEEP
+};
+static const struct builtin_entry builtins[] = {
+    [BUILTIN_EXIT] = {"exit", builtin_exit, true},
+    [BUILTIN_CD] = {"cd", builtin_cd, true},
+    [BUILTIN_PATH] = {"path", builtin_path, true},
+    [BUILTIN_HASH] = {"hash", builtin_hash, true},
+    [BUILTIN_WAIT] = {"wait", builtin_wait, true},
+    [BUILTIN_JOBS] = {"jobs", builtin_jobs, true},
+    [BUILTIN_PURE] = {"pure", builtin_pure, true},
+    [BUILTIN_AFFINITY] = {"affinity", builtin_affinity, true},
+    [BUILTIN_ECHO] = {"echo", builtin_echo, false},
+    [BUILTIN_TRUE] = {"true", builtin_true, false},
+    [BUILTIN_FALSE] = {"false", builtin_false, false},
+    [BUILTIN_PRINTF] = {"printf", builtin_printf, false},
+    [BUILTIN_TEST] = {"test", builtin_test, false},
+    [BUILTIN_BRACKET] = {"[", builtin_test, false},
+    [BUILTIN_PWD] = {"pwd", builtin_pwd, false},
+    [BUILTIN_SLEEP] = {"sleep", builtin_sleep, false},
+};
+/*
+Perfect hash of a builtin name from its length, first and last character, the way gperf
+picks key positions. The case labels below are the same macro over the names spelled
+out, so two builtins that collide are a duplicate case value and the build fails; pick
+new multipliers or another key position then. Every name hashes to at most one entry,
+which a single strcmp confirms.
+*/
+#define BUILTIN_MAX_NAME 8
+#define BUILTIN_HASH(len, first, last) ((((len) + (first)) * 2 + (last)) & 63)
+/*
+name: first word of a command
+Returns its builtin, NULL for an external command; utilities count as external with --external
+*/
+static const struct builtin_entry *find_builtin(const char *name)
+{
+  size_t len = strnlen(name, BUILTIN_MAX_NAME + 1);
+  if (len == 0 || len > BUILTIN_MAX_NAME)
+    return NULL;
+  enum builtin_id id;
+  switch (BUILTIN_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1]))
+  {
+  case BUILTIN_HASH(4, 'e', 't'):
+    id = BUILTIN_EXIT;
+    break;
+  case BUILTIN_HASH(2, 'c', 'd'):
+    id = BUILTIN_CD;
+    break;
+  case BUILTIN_HASH(4, 'p', 'h'):
+    id = BUILTIN_PATH;
+    break;
+  case BUILTIN_HASH(4, 'h', 'h'):
+    id = BUILTIN_HASH;
+    break;
+  case BUILTIN_HASH(4, 'w', 't'):
+    id = BUILTIN_WAIT;
+    break;
+  case BUILTIN_HASH(4, 'j', 's'):
+    id = BUILTIN_JOBS;
+    break;
+  case BUILTIN_HASH(4, 'p', 'e'):
+    id = BUILTIN_PURE;
+    break;
+  case BUILTIN_HASH(8, 'a', 'y'):
+    id = BUILTIN_AFFINITY;
+    break;
+  case BUILTIN_HASH(4, 'e', 'o'):
+    id = BUILTIN_ECHO;
+    break;
+  case BUILTIN_HASH(4, 't', 'e'):
+    id = BUILTIN_TRUE;
+    break;
+  case BUILTIN_HASH(5, 'f', 'e'):
+    id = BUILTIN_FALSE;
+    break;
+  case BUILTIN_HASH(6, 'p', 'f'):
+    id = BUILTIN_PRINTF;
+    break;
+  case BUILTIN_HASH(4, 't', 't'):
+    id = BUILTIN_TEST;
+    break;
+  case BUILTIN_HASH(1, '[', '['):
+    id = BUILTIN_BRACKET;
+    break;
+  case BUILTIN_HASH(3, 'p', 'd'):
+    id = BUILTIN_PWD;
+    break;
+  case BUILTIN_HASH(5, 's', 'p'):
+    id = BUILTIN_SLEEP;
+    break;
+  default:
+    return NULL;
+  }
+  if (strcmp(name, builtins[id].name) != 0)
+    return NULL; // Same hash, different command
+  return builtins[id].state || !options.external ? &builtins[id] : NULL;
+}
+/*
+name: a file that commands of the group write to
+fd: opened once for all of them, -1 if that failed
+truncate: some command used '>' or '2>' rather than '>>'
+append: some command writes to it directly; left out when only the shell does, for '|>',
+since splice(2) refuses O_APPEND files
+*/
+struct open_target
+{
+  const char *name;
+  int fd;
+  bool truncate;
+  bool append;
+};
+/*
+group: a parsed group
+count: receives the number of distinct files
+Opens every file the group writes to once, O_APPEND, so commands sharing one add to it
+instead of truncating and overwriting each other; a '>' truncates it that one time.
+Returns the files, in line_arena; count is -1 if out of memory
+*/
+static struct open_target *open_targets(struct group *group, int *count)
+{
+  struct open_target *targets = NULL;
+  size_t capacity = 0;
+  int c, st, r, t;
+  *count = 0;
+  for (c = 0; c < group->command_count; c++)
+  {
+    for (st = 0; st < group->commands[c].stage_count; st++)
+    {
+      struct stage *stage = &group->commands[c].stages[st];
+      for (r = 0; r < stage->redirect_count; r++)
+      {
+        struct redirect *redirect = &stage->redirects[r];
+        if (redirect->kind == REDIRECT_INPUT || redirect->kind == REDIRECT_ERROR_TO_OUTPUT)
+          continue;
+        for (t = 0; t < *count && strcmp(targets[t].name, redirect->target) != 0; t++)
+          ;
+        if (t == *count)
+        {
+          if ((targets = arena_push(&line_arena, targets, *count, &capacity, sizeof(struct open_target))) == NULL)
+          {
+            *count = -1; // Nothing is open yet
+            return NULL;
+          }
+          targets[t].name = redirect->target;
+          targets[t].truncate = false;
+          targets[t].append = false;
+          (*count)++;
+        }
+        if (redirect->kind != REDIRECT_APPEND)
+          targets[t].truncate = true;
+        if (redirect->kind != REDIRECT_TEE)
+          targets[t].append = true;
+      }
+    }
+  }
+  for (t = 0; t < *count; t++)
+  {
+    TRACE('B', "redirect", targets[t].name);
+    targets[t].fd = open(targets[t].name, O_WRONLY | O_CREAT | O_CLOEXEC | (targets[t].append ? O_APPEND : 0) | (targets[t].truncate ? O_TRUNC : 0), S_IRWXU);
+    TRACE('E', "redirect", targets[t].name);
+    if (targets[t].fd < 0)
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+    }
+  }
+  return targets;
+}
+/*
+stage: a command of the group
+targets, target_count: the group's open files, from open_targets
+fds: holds the pipe ends on entry, -1 for none; receives what the command's stdin, stdout
+and stderr become, as spawn_command wants them
+Returns false if a file couldn't be opened, already reported; fds[0] is a fresh descriptor
+the caller closes whenever it differs from the pipe end passed in. For '|>', fds[1] is the
+file and the caller puts a tee_stream in between
+*/
+static bool stage_fds(struct stage *stage, struct open_target *targets, int target_count, int fds[3])
+{
+  bool output = false, errors = false; // stdout to a file, stderr redirected on its own
+  int r, t;
+  for (r = 0; r < stage->redirect_count; r++)
+  {
+    struct redirect *redirect = &stage->redirects[r];
+    int fd = -1;
+    if (redirect->kind == REDIRECT_INPUT)
+    {
+      // Not shared: commands reading the same file side by side each need their own offset
+      fd = open(redirect->target, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+      {
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        return false;
+      }
+      fds[0] = fd;
+      continue;
+    }
+    if (redirect->kind == REDIRECT_ERROR_TO_OUTPUT)
+    {
+      fds[2] = STDOUT_FILENO; // dup2'd after stdout, so it follows a '>' written later as well
+      errors = true;
+      continue;
+    }
+    for (t = 0; t < target_count && strcmp(targets[t].name, redirect->target) != 0; t++)
+      ;
+    if (targets[t].fd < 0)
+      return false; // Reported when it was opened
+    if (redirect->kind == REDIRECT_ERROR)
+    {
+      fds[2] = targets[t].fd;
+      errors = true;
+    }
+    else
+    {
+      fds[1] = targets[t].fd;
+      output = redirect->kind != REDIRECT_TEE;
+    }
+  }
+  if (output && !errors)
+    fds[2] = STDOUT_FILENO; // '>' and '>>' take stderr along
+  return true;
+}
+// Function to tell whether a stage's stdout goes through '|>'
+static bool stage_tee(struct stage *stage)
+{
+  int r;
+  for (r = 0; r < stage->redirect_count; r++)
+  {
+    if (stage->redirects[r].kind == REDIRECT_TEE)
+      return true;
+  }
+  return false;
+}
+/*
+key, key_len: what the result depends on, see memo_key
+name: the entry's file name in the cache, from the key's hash
+out, err: temp files in the cache the command writes its stdout and stderr to
+out_name, err_name: their names until they are renamed after their content
+dest: copies of where stdout and stderr were meant to go, the result is replayed there
+*/
+struct memo_record
+{
+  char *key;
+  size_t key_len;
+  char name[24];
+  int out;
+  int err;
+  char out_name[32];
+  char err_name[32];
+  int dest[2];
+};
+// FNV-1a over a buffer, 64 bits wide since it names files shared across runs
+static uint64_t memo_hash(uint64_t h, const char *data, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+// Function to tell whether a command was declared pure
+static bool memo_pure(const char *name)
+{
+  size_t i;
+  for (i = 0; i < memo.pure_count; i++)
+  {
+    if (strcmp(memo.pure[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+/*
+key, len: buffer of MEMO_KEY bytes and how much of it is used
+text, size: what to add
+Returns false once it doesn't fit, the command is then just run
+*/
+static bool memo_add(char *key, size_t *len, const char *text, size_t size)
+{
+  if (size > MEMO_KEY - *len)
+    return false;
+  memcpy(key + *len, text, size);
+  *len += size;
+  return true;
+}
+// Function to add a file's identity to a key: mtime, size and inode, or that it isn't there
+static bool memo_add_file(char *key, size_t *len, const char *name)
+{
+  struct stat st;
+  char text[96];
+  int size = stat(name, &st) == 0 && !S_ISDIR(st.st_mode)
+                 ? snprintf(text, sizeof(text), "%lld.%09ld:%lld:%llu", (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                            (long long)st.st_size, (unsigned long long)st.st_ino)
+                 : snprintf(text, sizeof(text), "-");
+  return memo_add(key, len, text, size + 1);
+}
+/*
+stage: a single pure command
+executable: its resolved path
+key, len: receive what its result depends on: the path, argv, cwd, and the mtime, size and
+inode of every argument that names a file, and of its '<' file. Arguments that aren't files
+are stat()ed as well, so a file appearing later under that name changes the key
+Returns false if it doesn't fit in MEMO_KEY
+*/
+static bool memo_key(struct stage *stage, const char *executable, char *key, size_t *len)
+{
+  char cwd[MAX_PATH_LENGTH];
+  int i;
+  *len = 0;
+  if (getcwd(cwd, sizeof(cwd)) == NULL || !memo_add(key, len, executable, strlen(executable) + 1) || !memo_add(key, len, cwd, strlen(cwd) + 1))
+    return false;
+  for (i = 0; i < stage->args_count; i++)
+  {
+    if (!memo_add(key, len, stage->args[i], strlen(stage->args[i]) + 1) || (i > 0 && !memo_add_file(key, len, stage->args[i])))
+      return false;
+  }
+  for (i = 0; i < stage->redirect_count; i++)
+  {
+    if (stage->redirects[i].kind == REDIRECT_INPUT && !memo_add_file(key, len, stage->redirects[i].target))
+      return false;
+  }
+  return true;
+}
+// Function to copy a whole file to a descriptor, sendfile first, write() where it isn't taken
+static void memo_send(int from, int to)
+{
+  off_t size = lseek(from, 0, SEEK_END);
+  off_t offset = 0;
+  while (offset < size && sendfile(to, from, &offset, size - offset) > 0)
+    ;
+  char chunk[65536];
+  ssize_t got;
+  while (offset < size && (got = pread(from, chunk, sizeof(chunk), offset)) > 0)
+  {
+    write_all(to, chunk, got); // O_APPEND files and some terminals refuse sendfile
+    offset += got;
+  }
+}
+// Function to make a temp file in the cache, it gets its final name once complete
+static int memo_temp(char name[32])
+{
+  static unsigned counter;
+  snprintf(name, 32, "tmp.%d.%u", (int)getpid(), counter++);
+  return openat(memo.dir, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+}
+// Function to let go of a record without keeping anything
+static void memo_drop(struct memo_record *record)
+{
+  int i;
+  if (record->out >= 0)
+  {
+    close(record->out);
+    unlinkat(memo.dir, record->out_name, 0);
+  }
+  if (record->err >= 0)
+  {
+    close(record->err);
+    unlinkat(memo.dir, record->err_name, 0);
+  }
+  for (i = 0; i < 2; i++)
+  {
+    if (record->dest[i] >= 0)
+      close(record->dest[i]);
+  }
+}
+// Function to tell whether an entry names its output the way memo_keep does, hex hash and size
+static bool memo_name_valid(const char *name)
+{
+  const char *hex = "0123456789abcdef";
+  size_t size = strlen(name);
+  return size >= 18 && strspn(name, hex) == 16 && name[16] == '-' && strspn(name + 17, hex) == size - 17;
+}
+/*
+stage: a single command declared pure
+fds: from stage_fds
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+status: receives the exit status when it is replayed
+record: receives what memo_redirect needs to run and remember it; NULL when it can't be
+memoized, it is then run as usual
+Returns true if the cache had the result and it was written out, nothing to run
+*/
+static bool memo_replay(struct stage *stage, int fds[3], char *paths[], size_t *path_counter, int *status, struct memo_record **record)
+{
+  *record = NULL;
+  char *executable = find_executable(stage->args[0], paths, path_counter);
+  char *key = arena_alloc(&line_arena, MEMO_KEY);
+  size_t len;
+  if (executable == NULL || key == NULL || !memo_key(stage, executable, key, &len))
+    return false;
+  char name[24];
+  snprintf(name, sizeof(name), "k%016llx", (unsigned long long)memo_hash(14695981039346656037ULL, key, len));
+  int fd = openat(memo.dir, name, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    char *entry = arena_alloc(&line_arena, MEMO_KEY + 128);
+    ssize_t got = entry == NULL ? -1 : read(fd, entry, MEMO_KEY + 127);
+    close(fd);
+    char out_name[32], err_name[32];
+    int header = 0;
+    if (got > 0)
+    {
+      entry[got] = '\0';
+      if (sscanf(entry, "%d %31s %31s\n%n", status, out_name, err_name, &header) != 3 || header == 0 || !memo_name_valid(out_name) || !memo_name_valid(err_name))
+        got = 0; // Anything else could lead openat out of the cache directory
+    }
+    // A different key that hashed the same is a miss, the entry is replaced when it finishes
+    if (got > 0 && (size_t)(got - header) == len && memcmp(entry + header, key, len) == 0)
+    {
+      int out = openat(memo.dir, out_name, O_RDONLY | O_CLOEXEC);
+      int err = openat(memo.dir, err_name, O_RDONLY | O_CLOEXEC);
+      if (out >= 0 && err >= 0)
+      {
+        TRACE('i', "memo", stage->args[0]);
+        int to_out = fds[1] >= 0 ? fds[1] : STDOUT_FILENO;
+        memo_send(out, to_out);
+        memo_send(err, fds[2] == STDOUT_FILENO ? to_out : fds[2] >= 0 ? fds[2] : STDERR_FILENO);
+        close(out);
+        close(err);
+        return true;
+      }
+      if (out >= 0)
+        close(out);
+      if (err >= 0)
+        close(err);
+    }
+  }
+  struct memo_record *fresh = arena_alloc(&line_arena, sizeof(struct memo_record));
+  if (fresh == NULL)
+    return false;
+  fresh->key = key;
+  fresh->key_len = len;
+  memcpy(fresh->name, name, sizeof(name));
+  fresh->out = memo_temp(fresh->out_name);
+  fresh->err = memo_temp(fresh->err_name);
+  fresh->dest[0] = fresh->dest[1] = -1;
+  if (fresh->out < 0 || fresh->err < 0)
+  {
+    memo_drop(fresh);
+    return false;
+  }
+  *record = fresh;
+  return false;
+}
+/*
+record: from memo_replay
+fds: from stage_fds, changed so the command writes to the record's temp files and reads
+'<' or /dev/null, since stdin that isn't a file can't be part of the key
+*/
+static void memo_redirect(struct memo_record *record, int fds[3])
+{
+  record->dest[0] = fcntl(fds[1] >= 0 ? fds[1] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+  record->dest[1] = fcntl(fds[2] == STDOUT_FILENO ? record->dest[0] : fds[2] >= 0 ? fds[2] : STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+  fds[1] = record->out;
+  if (fds[2] != STDOUT_FILENO)
+    fds[2] = record->err; // Otherwise it follows stdout into the same file, interleaving kept
+  if (fds[0] < 0)
+    fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+/*
+fd, temp: one of a finished command's temp files and that file's name
+name: receives the content address it was renamed to
+*/
+static void memo_keep(int fd, const char *temp, char name[32])
+{
+  off_t size = lseek(fd, 0, SEEK_END);
+  uint64_t h = 14695981039346656037ULL;
+  char chunk[65536];
+  off_t offset = 0;
+  ssize_t got;
+  while (offset < size && (got = pread(fd, chunk, sizeof(chunk), offset)) > 0)
+  {
+    h = memo_hash(h, chunk, got);
+    offset += got;
+  }
+  snprintf(name, 32, "%016llx-%llx", (unsigned long long)h, (unsigned long long)size);
+  renameat(memo.dir, temp, memo.dir, name); // Same content, same name: replacing it changes nothing
+}
+/*
+record: a memoized command that has just been reaped
+status: its exit status
+Writes its output where it was meant to go, then files it under its content hash and the
+entry under the key's hash; killed commands are replayed but not remembered
+*/
+static void memo_store(struct memo_record *record, int status)
+{
+  memo_send(record->out, record->dest[0]);
+  memo_send(record->err, record->dest[1]);
+  if (status >= 128)
+  {
+    memo_drop(record);
+    return;
+  }
+  char out_name[32], err_name[32], entry_name[32];
+  memo_keep(record->out, record->out_name, out_name);
+  memo_keep(record->err, record->err_name, err_name);
+  close(record->out);
+  close(record->err);
+  record->out = record->err = -1;
+  int fd = memo_temp(entry_name);
+  if (fd >= 0)
+  {
+    char header[96];
+    int len = snprintf(header, sizeof(header), "%d %s %s\n", status, out_name, err_name);
+    write_all(fd, header, len);
+    write_all(fd, record->key, record->key_len);
+    close(fd);
+    renameat(memo.dir, entry_name, memo.dir, record->name); // Atomic, a concurrent -j worker sees the old or the new
+  }
+  memo_drop(record);
+}
+/*
+entry: the builtin
+current: its stage
+fds: from stage_fds
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Runs it in the shell with stdin, stdout and stderr swapped for the duration, the way a
+child would have them.
+Returns the exit status, or BUILTIN_EXTERNAL if it has to be run as a program after all
+*/
+static int run_builtin(const struct builtin_entry *entry, struct stage *current, int fds[3], char *paths[], size_t *path_counter)
+{
+  int saved[3] = {-1, -1, -1};
+  int i;
+  fflush(stdout); // Anything buffered belongs to the old stdout
+  for (i = 0; i < 3; i++)
+  {
+    if (fds[i] < 0)
+      continue;
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    dup2(fds[i], i);
+  }
+  int rc = entry->run(current->args, current->args_count, paths, path_counter);
+  fflush(stdout);
+  for (i = 2; i >= 0; i--)
+  {
+    if (saved[i] < 0)
+      continue;
+    dup2(saved[i], i);
+    close(saved[i]);
+  }
+  return rc;
+}
+/*
+TOKEN_WORD: text up to the next blank or operator, NUL terminated in place
+TOKEN_END: end of line or newline
+*/
+enum token_kind
+{
+  TOKEN_WORD,
+  TOKEN_AND,
+  TOKEN_PIPE,
+  TOKEN_GREATER,
+  TOKEN_APPEND,
+  TOKEN_ERROR_GREATER,
+  TOKEN_ERROR_TO_OUTPUT,
+  TOKEN_LESS,
+  TOKEN_TEE,
+  TOKEN_SEMICOLON,
+  TOKEN_END
+};
+/*
+kind: token type
+text: the word for TOKEN_WORD
+position: offset of the token in the line
+*/
+struct token
+{
+  enum token_kind kind;
+  char *text;
+  size_t position;
+};
+/*
+line: start of the line, positions are relative to it
+current: next unread character
+pending: operator that ended the previous word, its character already overwritten by '\0'
+pending_position: where that operator was
+*/
+struct lexer
+{
+  char *line;
+  char *current;
+  char pending;
+  size_t pending_position;
+};
+// Function to tell which token an operator character starts
+static enum token_kind operator_kind(char c)
+{
+  switch (c)
+  {
+  case '&':
+    return TOKEN_AND;
+  case '|':
+    return TOKEN_PIPE;
+  case '>':
+    return TOKEN_GREATER;
+  case '<':
+    return TOKEN_LESS;
+  case ';':
+    return TOKEN_SEMICOLON;
+  default:
+    return TOKEN_WORD;
+  }
+}
+/*
+lexer: lexer->current is just past a '>'
+Returns TOKEN_APPEND and takes the second character for '>>', TOKEN_GREATER otherwise
+*/
+static enum token_kind lex_greater(struct lexer *lexer)
+{
+  if (*lexer->current != '>')
+    return TOKEN_GREATER;
+  lexer->current++;
+  return TOKEN_APPEND;
+}
+/*
+lexer: lexer->current is just past a '|'
+Returns TOKEN_TEE and takes the second character for '|>', TOKEN_PIPE otherwise
+*/
+static enum token_kind lex_pipe(struct lexer *lexer)
+{
+  if (*lexer->current != '>')
+    return TOKEN_PIPE;
+  lexer->current++;
+  return TOKEN_TEE;
+}
+/*
+lexer: position in the line
+token: receives the next token
+Every character is looked at exactly once, words are terminated in place
+*/
+static void lex_next(struct lexer *lexer, struct token *token)
+{
+  if (lexer->pending != '\0')
+  {
+    token->kind = operator_kind(lexer->pending);
+    token->text = NULL;
+    token->position = lexer->pending_position;
+    lexer->pending = '\0';
+    if (token->kind == TOKEN_GREATER)
+      token->kind = lex_greater(lexer);
+    else if (token->kind == TOKEN_PIPE)
+      token->kind = lex_pipe(lexer);
+    return;
+  }
+  char *p = lexer->current;
+  while (*p == ' ' || *p == '\t' || *p == '\r') // Disregard all the blanks
+  {
+    p++;
+  }
+  token->position = p - lexer->line;
+  token->text = NULL;
+  if (*p == '\0' || *p == '\n')
+  {
+    *p = '\0';
+    token->kind = TOKEN_END;
+    lexer->current = p;
+    return;
+  }
+  if (p[0] == '2' && p[1] == '>') // Only at the start of a word: 'a2>f' is 'a2' '>' 'f'
+  {
+    bool duplicate = p[2] == '&' && p[3] == '1';
+    token->kind = duplicate ? TOKEN_ERROR_TO_OUTPUT : TOKEN_ERROR_GREATER;
+    lexer->current = p + (duplicate ? 4 : 2);
+    return;
+  }
+  token->kind = operator_kind(*p);
+  if (token->kind != TOKEN_WORD)
+  {
+    lexer->current = p + 1;
+    if (token->kind == TOKEN_GREATER)
+      token->kind = lex_greater(lexer);
+    else if (token->kind == TOKEN_PIPE)
+      token->kind = lex_pipe(lexer);
+    return;
+  }
+  token->text = p;
+  while (*p != '\0' && *p != '\n' && *p != ' ' && *p != '\t' && *p != '\r' && operator_kind(*p) == TOKEN_WORD)
+  {
+    p++;
+  }
+  if (*p == '\0' || *p == '\n')
+  {
+    *p = '\0';
+    lexer->current = p; // The next call sees the end
+    return;
+  }
+  if (operator_kind(*p) != TOKEN_WORD)
+  {
+    lexer->pending = *p; // 'ls>out': remember the '>' before cutting the word
+    lexer->pending_position = p - lexer->line;
+  }
+  *p = '\0';
+  lexer->current = p + 1;
+}
+// Function to tell the redirect operators from the other tokens
+static bool redirect_token(enum token_kind kind)
+{
+  return kind == TOKEN_GREATER || kind == TOKEN_APPEND || kind == TOKEN_ERROR_GREATER || kind == TOKEN_ERROR_TO_OUTPUT || kind == TOKEN_LESS || kind == TOKEN_TEE;
+}
+// Function to record where and why parsing failed
+static bool parse_fail(struct parse_error *error, size_t position, const char *message)
+{
+  error->position = position;
+  error->message = message;
+  return false;
+}
+/*
+string: Entire Line, tokenized in place
+ast: receives the sequences of parallel groups of pipelines, all in line_arena
+error: where and why, when parsing fails
+Returns false on a syntax error, nothing is run or printed here
+*/
+static bool parse_line(char *string, struct line_ast *ast, struct parse_error *error)
+{
+  struct lexer lexer = {string, string, '\0', 0};
+  struct token token;
+  size_t group_capacity = 0;
+  memset(ast, 0, sizeof(*ast));
+  lex_next(&lexer, &token);
+  while (token.kind != TOKEN_END)
+  {
+    ast->groups = arena_push(&line_arena, ast->groups, ast->group_count, &group_capacity, sizeof(struct group));
+    if (ast->groups == NULL)
+      return parse_fail(error, token.position, "out of memory");
+    struct group *group = &ast->groups[ast->group_count++];
+    size_t command_capacity = 0;
+    memset(group, 0, sizeof(*group));
+    while (1) // One '&' separated pipeline per round
+    {
+      group->commands = arena_push(&line_arena, group->commands, group->command_count, &command_capacity, sizeof(struct command));
+      if (group->commands == NULL)
+        return parse_fail(error, token.position, "out of memory");
+      struct command *command = &group->commands[group->command_count++];
+      size_t stage_capacity = 0;
+      memset(command, 0, sizeof(*command));
+      while (1) // One '|' separated stage per round
+      {
+        command->stages = arena_push(&line_arena, command->stages, command->stage_count, &stage_capacity, sizeof(struct stage));
+        if (command->stages == NULL)
+          return parse_fail(error, token.position, "out of memory");
+        struct stage *stage = &command->stages[command->stage_count++];
+        size_t args_capacity = 0;
+        size_t redirect_capacity = 0;
+        memset(stage, 0, sizeof(*stage));
+        bool input = false, output = false, errors = false; // Streams already redirected
+        bool teed = false; // stdout went to '|>', which keeps the pipe
+        while (token.kind == TOKEN_WORD || redirect_token(token.kind))
+        {
+          if (token.kind == TOKEN_WORD)
+          {
+            if (stage->redirect_count > 0)
+              return parse_fail(error, token.position, "only one file after a redirect");
+            stage->args = arena_push(&line_arena, stage->args, stage->args_count, &args_capacity, sizeof(char *));
+            if (stage->args == NULL)
+              return parse_fail(error, token.position, "out of memory");
+            stage->args[stage->args_count++] = token.text;
+            lex_next(&lexer, &token);
+            continue;
+          }
+          size_t position = token.position;
+          enum token_kind kind = token.kind;
+          if (stage->args_count == 0)
+            return parse_fail(error, position, "redirect without a command");
+          bool *stream = kind == TOKEN_LESS ? &input : (kind == TOKEN_GREATER || kind == TOKEN_APPEND || kind == TOKEN_TEE ? &output : &errors);
+          if (*stream)
+            return parse_fail(error, position, kind == TOKEN_LESS ? "more than one '<'" : (stream == &output ? "more than one '>'" : "more than one '2>'"));
+          if (kind == TOKEN_LESS && command->stage_count > 1)
+            return parse_fail(error, position, "'<' after the start of a pipeline");
+          *stream = true;
+          if (kind == TOKEN_TEE)
+            teed = true; // A '2>' or '<' after it leaves stdout where '|>' put it
+          lex_next(&lexer, &token);
+          char *target = NULL;
+          if (kind != TOKEN_ERROR_TO_OUTPUT)
+          {
+            if (token.kind != TOKEN_WORD)
+              return parse_fail(error, token.position, "redirect without a file");
+            target = token.text;
+            lex_next(&lexer, &token);
+          }
+          stage->redirects = arena_push(&line_arena, stage->redirects, stage->redirect_count, &redirect_capacity, sizeof(struct redirect));
+          if (stage->redirects == NULL)
+            return parse_fail(error, token.position, "out of memory");
+          struct redirect *redirect = &stage->redirects[stage->redirect_count++];
+          redirect->kind = kind == TOKEN_GREATER ? REDIRECT_OUTPUT : kind == TOKEN_APPEND ? REDIRECT_APPEND : kind == TOKEN_ERROR_GREATER ? REDIRECT_ERROR : kind == TOKEN_ERROR_TO_OUTPUT ? REDIRECT_ERROR_TO_OUTPUT : kind == TOKEN_TEE ? REDIRECT_TEE : REDIRECT_INPUT;
+          redirect->target = target;
+          redirect->position = position;
+        }
+        stage->args = arena_push(&line_arena, stage->args, stage->args_count, &args_capacity, sizeof(char *));
+        if (stage->args == NULL)
+          return parse_fail(error, token.position, "out of memory");
+        stage->args[stage->args_count] = NULL;
+        if (token.kind != TOKEN_PIPE)
+          break;
+        if (stage->args_count == 0)
+          return parse_fail(error, token.position, "'|' without a command before it");
+        if (output && !teed)
+          return parse_fail(error, token.position, "'>' before the end of a pipeline");
+        lex_next(&lexer, &token);
+      }
+      struct stage *last = &command->stages[command->stage_count - 1];
+      if (last->args_count == 0 && (command->stage_count > 1 || token.kind == TOKEN_AND))
+        return parse_fail(error, token.position, command->stage_count > 1 ? "'|' without a command after it" : "'&' without a command before it");
+      if (token.kind != TOKEN_AND)
+        break;
+      lex_next(&lexer, &token);
+      if (token.kind == TOKEN_END || token.kind == TOKEN_SEMICOLON)
+      {
+        group->background = true; // A trailing '&' is allowed
+        break;
+      }
+    }
+    if (token.kind == TOKEN_SEMICOLON)
+    {
+      if (group->commands[0].stages[0].args_count == 0)
+        return parse_fail(error, token.position, "';' without a command before it");
+      lex_next(&lexer, &token);
+    }
+    else if (token.kind != TOKEN_END)
+      return parse_fail(error, token.position, "unexpected operator");
+  }
+  return true;
+}
+/*
+text: the command as written
+wall, user, sys: seconds it took
+maxrss: peak resident set in KB
+status: exit status
+*/
+static void stats_record(const char *text, double wall, double user, double sys, long maxrss, int status)
+{
+  stats.commands++;
+  stats.user += user;
+  stats.sys += sys;
+  if (maxrss > stats.maxrss)
+    stats.maxrss = maxrss;
+  if (status != 0)
+    stats.failed++;
+  // Insertion into the short slowest-first list
+  int i = stats.slowest_count < STATS_SLOWEST ? stats.slowest_count++ : STATS_SLOWEST;
+  for (; i > 0 && stats.slowest[i - 1].wall < wall; i--)
+  {
+    if (i < STATS_SLOWEST)
+      stats.slowest[i] = stats.slowest[i - 1];
+  }
+  if (i < STATS_SLOWEST)
+  {
+    stats.slowest[i].wall = wall;
+    snprintf(stats.slowest[i].text, sizeof(stats.slowest[i].text), "%s", text);
+  }
+}
+/*
+wall: seconds the whole line took
+print: false when the line already reported itself from a -j worker
+Prints the line's summary and folds it into the run totals
+*/
+static void stats_line(double wall, bool print)
+{
+  stats.total_lines++;
+  if (print)
+  {
+    fprintf(stderr, "stats: line %zu: %zu commands, %zu failed, wall %.3fs, user %.3fs, sys %.3fs, max rss %ld KB\n",
+            stats.line_number, stats.commands, stats.failed, wall, stats.user, stats.sys, stats.maxrss);
+  }
+  stats.total_commands += stats.commands;
+  stats.total_failed += stats.failed;
+  stats.total_wall += wall;
+  stats.total_user += stats.user;
+  stats.total_sys += stats.sys;
+  if (stats.maxrss > stats.total_maxrss)
+    stats.total_maxrss = stats.maxrss;
+  stats.commands = stats.failed = 0;
+  stats.user = stats.sys = 0;
+  stats.maxrss = 0;
+}
+// Function to print the end of batch summary with the slowest commands
+static void stats_batch(void)
+{
+  fprintf(stderr, "stats: total: %zu lines, %zu commands, %zu failed, wall %.3fs, user %.3fs, sys %.3fs, max rss %ld KB\n",
+          stats.total_lines, stats.total_commands, stats.total_failed, stats.total_wall, stats.total_user, stats.total_sys, stats.total_maxrss);
+  int i;
+  for (i = 0; i < stats.slowest_count; i++)
+  {
+    fprintf(stderr, "stats: slowest %d: %.3fs %s\n", i + 1, stats.slowest[i].wall, stats.slowest[i].text);
+  }
+}
+/*
+pid: the process, 0 once reaped
+job: index of the '&' command it runs for
+*/
+struct child
+{
+  pid_t pid;
+  int job;
+};
+/*
+alive: stages still running
+timed: started with the 'time' prefix
+started, finished: CLOCK_MONOTONIC around the whole pipeline
+user, sys: CPU seconds of every stage, from wait4
+maxrss: largest resident set of any stage, in KB
+status: exit status of the last stage that failed, 0 if none did
+memo: set when a pure command runs with --memo, its result is replayed and kept once it is reaped
+*/
+struct job
+{
+  int alive;
+  bool timed;
+  struct timespec started;
+  struct timespec finished;
+  double user;
+  double sys;
+  long maxrss;
+  int status;
+  struct memo_record *memo;
+};
+// Function to turn a struct timeval from rusage into seconds
+static double timeval_seconds(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+// Function to get the seconds between two CLOCK_MONOTONIC readings
+static double timespec_seconds(struct timespec start, struct timespec end)
+{
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+/*
+children: processes launched for the group, reaped ones get pid 0
+child_count: number of children
+jobs: accounting per '&' command
+Returns the index of the '&' command whose last stage was just reaped, -1 once there is no child left
+*/
+static int reap_job(struct child children[], int child_count, struct job jobs[])
+{
+  while (1)
+  {
+    int wstatus;
+    struct rusage usage;
+    pid_t pid = reap_any(&wstatus, &usage); // Whichever child exits first, with what it used
+    if (pid < 0)
+      return -1;
+    int i;
+    for (i = 0; i < child_count && children[i].pid != pid; i++)
+      ;
+    if (i == child_count)
+    {
+      background_reaped(pid, wstatus); // Not launched by this line
+      continue;
+    }
+    children[i].pid = 0;
+    struct job *job = &jobs[children[i].job];
+    job->user += timeval_seconds(usage.ru_utime);
+    job->sys += timeval_seconds(usage.ru_stime);
+    if (usage.ru_maxrss > job->maxrss)
+      job->maxrss = usage.ru_maxrss;
+    if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0)
+      job->status = WEXITSTATUS(wstatus);
+    else if (WIFSIGNALED(wstatus))
+      job->status = 128 + WTERMSIG(wstatus);
+    if (--job->alive == 0)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &job->finished);
+      return children[i].job; // Every stage of that command is done
+    }
+  }
+}
+/*
+command: a parsed pipeline
+text: receives it written out again, cut at STATS_TEXT
+*/
+static void command_text(struct command *command, char text[STATS_TEXT])
+{
+  size_t used = 0;
+  int st, i;
+  text[0] = '\0';
+  for (st = 0; st < command->stage_count && used < STATS_TEXT; st++)
+  {
+    for (i = 0; i < command->stages[st].args_count && used < STATS_TEXT; i++)
+    {
+      used += snprintf(text + used, STATS_TEXT - used, "%s%s", used == 0 ? "" : (i == 0 ? " | " : " "), command->stages[st].args[i]);
+    }
+  }
+}
+/*
+command: a finished pipeline
+job: what it used
+Prints the 'time' report and feeds --stats
+*/
+static void finish_job(struct command *command, struct job *job)
+{
+  if (job->memo != NULL)
+  {
+    memo_store(job->memo, job->status);
+    job->memo = NULL;
+  }
+  double wall = timespec_seconds(job->started, job->finished);
+  if (job->timed)
+  {
+    fprintf(stderr, "real %.3f\nuser %.3f\nsys %.3f\n", wall, job->user, job->sys);
+  }
+  if (options.stats)
+  {
+    char text[STATS_TEXT];
+    command_text(command, text);
+    stats_record(text, wall, job->user, job->sys, job->maxrss, job->status);
+  }
+}
+/*
+command: a pipeline just launched with a trailing '&'
+children: its stages, taken over by the new job
+count: number of stages
+Returns false if every slot is taken, the caller then waits for it in the foreground
+*/
+static bool background_add(struct command *command, struct child children[], int count)
+{
+  int i, id = 1, free_slot = -1;
+  for (i = 0; i < MAX_BACKGROUND; i++)
+  {
+    if (background[i].id == 0 && free_slot < 0)
+      free_slot = i;
+    else if (background[i].id >= id)
+      id = background[i].id + 1;
+  }
+  if (free_slot < 0)
+    return false;
+  struct background_job *job = &background[free_slot];
+  job->pids = malloc(count * sizeof(pid_t));
+  if (job->pids == NULL)
+    return false;
+  for (i = 0; i < count; i++)
+    job->pids[i] = children[i].pid;
+  job->id = id;
+  job->pid_count = count;
+  job->alive = count;
+  job->status = 0;
+  command_text(command, job->text);
+  fprintf(stderr, "[%d] %d\n", id, (int)children[count - 1].pid);
+  return true;
+}
+/*
+group: '&' separated pipelines of a parsed line
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+background: hand the pipelines to the background job table instead of waiting for them
+Returns 0 if every command succeeded, otherwise the status of a failed one
+*/
+static int run_group(struct group *group, char *paths[], size_t *path_counter, bool background)
+{
+  int total_stages = 0;
+  int status = 0;
+  int cmd = 0;
+  for (; cmd < group->command_count; cmd++)
+  {
+    total_stages += group->commands[cmd].stage_count;
+  }
+  struct child *children = arena_alloc(&line_arena, (total_stages + 1) * sizeof(struct child)); // Children Arr, every stage of every pipeline
+  struct job *jobs = arena_alloc(&line_arena, (group->command_count + 1) * sizeof(struct job));   // Accounting per '&' command
+  int running = 0; // '&' commands with at least one stage alive
+  int done;
+  int child_count = 0;
+  int target_count = -1;
+  struct open_target *targets = children == NULL || jobs == NULL ? NULL : open_targets(group, &target_count);
+  if (target_count < 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message)); // Out of memory, nothing was started
+    return 1;
+  }
+  // Only commands running side by side can mix their output
+  struct capture *capture = NULL;
+  if (options.capture != CAPTURE_OFF && !background && group->command_count > 1 && events.epoll_fd >= 0)
+    capture = capture_open(group->command_count);
+  struct tee_stream *tees = NULL;
+  int placed = 0; // Processes launched so far, for --affinity
+  // For every command, we execute them
+  for (cmd = 0; cmd < group->command_count; cmd++)
+  {
+    struct command *command = &group->commands[cmd];
+    struct job *job = &jobs[cmd];
+    memset(job, 0, sizeof(*job));
+    // If there's zero arg, just go to the next round.
+    if (command->stages[0].args_count == 0)
+      continue;
+    if (strcmp(command->stages[0].args[0], "time") == 0)
+    {
+      // Prefix builtin: time the rest of the pipeline
+      job->timed = true;
+      command->stages[0].args++;
+      command->stages[0].args_count--;
+      if (command->stages[0].args_count == 0)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+        job->finished = job->started;
+        finish_job(command, job);
+        continue;
+      }
+    }
+    struct placement pinned; // From an 'affinity CPUS' prefix, overrides --affinity
+    bool prefixed = command->stages[0].args_count > 2 && strcmp(command->stages[0].args[0], "affinity") == 0;
+    if (prefixed && !affinity_parse(command->stages[0].args[1], &pinned))
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      status = 1;
+      continue;
+    }
+    if (prefixed)
+    {
+      command->stages[0].args += 2;
+      command->stages[0].args_count -= 2;
+    }
+
+    const struct builtin_entry *entry = command->stage_count == 1 ? find_builtin(command->stages[0].args[0]) : NULL;
+    if (entry != NULL && !entry->state && (capture != NULL || (!background && stage_tee(&command->stages[0]))))
+      entry = NULL; // Run as a program, so its output goes through the capture or tee pipes in turn
+    if (entry != NULL)
+    {
+      int fds[3] = {-1, -1, -1};
+      clock_gettime(CLOCK_MONOTONIC, &job->started);
+      int rc = stage_fds(&command->stages[0], targets, target_count, fds) ? run_builtin(entry, &command->stages[0], fds, paths, path_counter) : 1;
+      if (fds[0] >= 0)
+        close(fds[0]);
+      if (rc != BUILTIN_EXTERNAL)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+        job->status = rc;
+        finish_job(command, job);
+        continue;
+      }
+    }
+    // A pure command seen before, with the same files, is replayed from the cache instead
+    if (memo.dir >= 0 && capture == NULL && !background && command->stage_count == 1 && !stage_tee(&command->stages[0]) && memo_pure(command->stages[0].args[0]))
+    {
+      int fds[3] = {-1, -1, -1};
+      clock_gettime(CLOCK_MONOTONIC, &job->started);
+      bool opened = stage_fds(&command->stages[0], targets, target_count, fds);
+      bool replayed = opened && memo_replay(&command->stages[0], fds, paths, path_counter, &job->status, &job->memo);
+      if (fds[0] >= 0)
+        close(fds[0]);
+      if (!opened)
+      {
+        status = 1; // Already reported
+        continue;
+      }
+      if (replayed)
+      {
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+        finish_job(command, job);
+        continue;
+      }
+    }
+    // Hold the command back until a slot frees up, whichever one finishes first
+    while (!background && running >= options.max_jobs && (done = reap_job(children, child_count, jobs)) >= 0)
+    {
+      finish_job(&group->commands[done], &jobs[done]);
+      running--;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    int captured[2] = {-1, -1}; // Write ends of the capture pipes, stdout and stderr
+    if (capture != NULL && !capture_pipes(capture, cmd, captured))
+      captured[0] = captured[1] = -1;
+    // Launch every stage before waiting so data streams through the pipes
+    int first_child = child_count;
+    int in_fd = -1;
+    int stage = 0;
+    for (; stage < command->stage_count; stage++)
+    {
+      int pipe_fds[2] = {-1, -1};
+      bool last = stage == command->stage_count - 1;
+      if (!last)
+      {
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+        {
+          write(STDERR_FILENO, error_message, strlen(error_message));
+          break;
+        }
+        if (options.pipe_size > 0)
+        {
+          fcntl(pipe_fds[1], F_SETPIPE_SZ, options.pipe_size); // Best effort, capped by /proc/sys/fs/pipe-max-size
+        }
+      }
+      struct stage *current = &command->stages[stage];
+      int fds[3] = {in_fd, last ? captured[0] : pipe_fds[1], captured[1]};
+      int tee_fd = -1;
+      bool ready = stage_fds(current, targets, target_count, fds);
+      // A background command outlives the line its tee would live in, it gets the file alone
+      if (ready && !background && stage_tee(current))
+      {
+        int out = !last ? pipe_fds[1] : captured[0] >= 0 ? captured[0] : STDOUT_FILENO;
+        if (tee_open(fds[1], out, &tees, &tee_fd))
+          fds[1] = tee_fd;
+      }
+      if (ready && job->memo != NULL)
+        memo_redirect(job->memo, fds);
+      // Only commands running side by side are placed, a line on its own goes where the kernel puts it
+      struct placement placement;
+      bool place = prefixed || (group->command_count > 1 && affinity_place(cmd, placed++, &placement));
+      pid_t pid = ready ? execute_command(current->args, paths, path_counter, fds, current->executable, !place ? NULL : prefixed ? &pinned : &placement) : -1;
+      if (pid < 0 && job->memo != NULL)
+      {
+        memo_drop(job->memo); // Nothing will be reaped to remember
+        job->memo = NULL;
+      }
+      if (fds[0] != in_fd)
+      {
+        close(fds[0]); // From '<', the parser only allows it where there is no pipe
+      }
+      if (pid > 0)
+      {
+        children[child_count].job = cmd;
+        children[child_count++].pid = pid;
+        job->alive++;
+      }
+      else
+      {
+        status = 1; // Not found or failed to launch, already reported
+      }
+      // The children hold their own copies now
+      if (in_fd >= 0)
+      {
+        close(in_fd);
+      }
+      if (pipe_fds[1] >= 0)
+      {
+        close(pipe_fds[1]);
+      }
+      if (tee_fd >= 0)
+      {
+        close(tee_fd);
+      }
+      in_fd = pipe_fds[0];
+    }
+    if (in_fd >= 0)
+    {
+      close(in_fd); // Launching stopped early
+    }
+    if (captured[0] >= 0)
+    {
+      close(captured[0]);
+      close(captured[1]);
+    }
+    if (background && job->alive > 0 && background_add(command, &children[first_child], child_count - first_child))
+    {
+      child_count = first_child; // Reaped through the job table from now on
+      job->alive = 0;
+    }
+    if (job->alive > 0)
+    {
+      running++;
+    }
+  }
+  int t;
+  for (t = 0; t < target_count; t++)
+  {
+    if (targets[t].fd >= 0)
+      close(targets[t].fd); // The commands hold their own copies
+  }
+  // Waiting for all the children, the line is done only when every one is reaped
+  while (running > 0 && (done = reap_job(children, child_count, jobs)) >= 0)
+  {
+    finish_job(&group->commands[done], &jobs[done]);
+    running--;
+  }
+  tee_finish(tees); // Before the capture, a tee may be writing into its pipes
+  if (capture != NULL)
+  {
+    capture_finish(capture);
+  }
+  for (cmd = 0; cmd < group->command_count; cmd++)
+  {
+    if (jobs[cmd].status != 0)
+      status = jobs[cmd].status;
+  }
+  return status;
+}
+/*
+ast: a parsed line, from parse_line or a compiled script
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+interactive: background groups are handed to the job table
+started: when the line was picked up, for --stats
+Returns 0 if every command succeeded, otherwise the status of a failed one
+*/
+static int run_line(struct line_ast *ast, char *paths[], size_t *path_counter, bool interactive, struct timespec started)
+{
+  struct timespec finished;
+  int status = 0;
+  int i;
+  for (i = 0; i < ast->group_count; i++) // ';' waits for the group before it
+  {
+    int rc = run_group(&ast->groups[i], paths, path_counter, interactive && ast->groups[i].background);
+    if (rc != 0)
+      status = rc;
+  }
+  if (options.stats && ast->group_count > 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    stats_line(timespec_seconds(started, finished), true);
+  }
+  arena_reset(&line_arena); // O(1), the chunks are kept for the next line
+  return status;
+}
+/*
+string: Entire Line
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Returns 0 if every command succeeded, otherwise the status of a failed one
+*/
+static int process_line(char *string, char *paths[], size_t *path_counter, bool interactive)
+{
+  struct line_ast ast; // Lives in line_arena, dropped at the end
+  struct parse_error error;
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  TRACE('B', "parse", NULL);
+  bool parsed = parse_line(string, &ast, &error);
+  TRACE('E', "parse", NULL);
+  if (!parsed)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    arena_reset(&line_arena);
+    return 1;
+  }
+  return run_line(&ast, paths, path_counter, interactive, started);
+}
+/*
+fd: the batch script, STDIN_FILENO for '-'
+map, map_len: the whole script when it could be mapped, NULL for pipes and terminals
+offset: start of the next line, in map or in buffer
+buffer, buffer_len, buffer_size: streaming window used instead of map
+eof: read() returned 0
+scratch, scratch_size: writable copy of the current line for process_line
+*/
+struct batch_reader
+{
+  int fd;
+  char *map;
+  size_t map_len;
+  size_t offset;
+  char *buffer;
+  size_t buffer_len;
+  size_t buffer_size;
+  bool eof;
+  char *scratch;
+  size_t scratch_size;
+};
+/*
+reader: zeroed reader to set up
+file: path of the batch script, "-" reads it from stdin
+Returns false if the script can't be opened
+*/
+static bool batch_open(struct batch_reader *reader, const char *file)
+{
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY | O_CLOEXEC);
+  if (reader->fd < 0)
+  {
+    return false;
+  }
+  struct stat st;
+  if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map != MAP_FAILED)
+    {
+      madvise(map, st.st_size, MADV_SEQUENTIAL); // Aggressive read-ahead, drop pages behind us
+      reader->map = map;
+      reader->map_len = st.st_size;
+      return true;
+    }
+  }
+  // Pipe, terminal or anything else mmap refuses: stream it in chunks
+  reader->buffer_size = BATCH_CHUNK;
+  reader->buffer = malloc(reader->buffer_size);
+  return reader->buffer != NULL;
+}
+/*
+reader: an opened reader
+len: receives the length of the line, without its newline
+Returns the start of the next line inside the mapping or the stream buffer,
+valid until the next call, or NULL at the end of the script
+*/
+static const char *batch_next(struct batch_reader *reader, size_t *len)
+{
+  if (reader->map != NULL)
+  {
+    if (reader->offset >= reader->map_len)
+      return NULL;
+    const char *line = reader->map + reader->offset;
+    const char *newline = memchr(line, '\n', reader->map_len - reader->offset);
+    *len = newline != NULL ? (size_t)(newline - line) : reader->map_len - reader->offset;
+    reader->offset += *len + 1;
+    return line;
+  }
+  while (1)
+  {
+    char *line = reader->buffer + reader->offset;
+    size_t available = reader->buffer_len - reader->offset;
+    char *newline = memchr(line, '\n', available);
+    if (newline != NULL)
+    {
+      *len = newline - line;
+      reader->offset += *len + 1;
+      return line;
+    }
+    if (reader->eof)
+    {
+      if (available == 0)
+        return NULL;
+      *len = available; // Last line without a newline
+      reader->offset = reader->buffer_len;
+      return line;
+    }
+    // Keep the partial line, then refill behind it
+    memmove(reader->buffer, line, available);
+    reader->offset = 0;
+    reader->buffer_len = available;
+    if (reader->buffer_len == reader->buffer_size)
+    {
+      char *bigger = realloc(reader->buffer, reader->buffer_size * 2); // A line longer than the window
+      if (bigger == NULL)
+        return NULL;
+      reader->buffer = bigger;
+      reader->buffer_size *= 2;
+    }
+    ssize_t got = read(reader->fd, reader->buffer + reader->buffer_len, reader->buffer_size - reader->buffer_len);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      reader->eof = true;
+    else
+      reader->buffer_len += got;
+  }
+}
+/*
+reader: an opened reader
+line, len: a line returned by batch_next
+Returns a NUL terminated copy process_line may cut up, reused for every line
+*/
+static char *batch_line(struct batch_reader *reader, const char *line, size_t len)
+{
+  if (reader->scratch_size < len + 1)
+  {
+    size_t size = reader->scratch_size == 0 ? 256 : reader->scratch_size;
+    while (size < len + 1)
+      size *= 2;
+    char *scratch = realloc(reader->scratch, size);
+    if (scratch == NULL)
+      return NULL;
+    reader->scratch = scratch;
+    reader->scratch_size = size;
+  }
+  memcpy(reader->scratch, line, len);
+  reader->scratch[len] = '\0';
+  return reader->scratch;
+}
+// Function to release everything batch_open set up
+static void batch_close(struct batch_reader *reader)
+{
+  if (reader->map != NULL)
+    munmap(reader->map, reader->map_len);
+  free(reader->buffer);
+  free(reader->scratch);
+  if (reader->fd != STDIN_FILENO)
+    close(reader->fd);
+}
+// Function to tell if a line has nothing to run, those are never copied
+static bool blank_line(const char *line, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+  {
+    if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+      return false;
+  }
+  return true;
+}
+/*
+string: copy of a batch line, cut up in place
+targets: receives every file a command redirects to or from, at most MAX_TARGETS
+target_count: number of targets
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Returns true if the line must run in the shell itself, in order: a builtin that changes
+shell state, the 'wait' barrier, or anything odd whose error has to be reported in place
+*/
+static bool scan_line(char *string, char *targets[], int *target_count, char *paths[], size_t *path_counter)
+{
+  struct line_ast ast;
+  struct parse_error error;
+  *target_count = 0;
+  if (!parse_line(string, &ast, &error))
+    return true; // Let process_line report it
+  int g, c, st, r;
+  for (g = 0; g < ast.group_count; g++)
+  {
+    for (c = 0; c < ast.groups[g].command_count; c++)
+    {
+      struct command *command = &ast.groups[g].commands[c];
+      for (st = 0; st < command->stage_count; st++)
+      {
+        struct stage *stage = &command->stages[st];
+        for (r = 0; r < stage->redirect_count; r++)
+        {
+          if (stage->redirects[r].target == NULL)
+            continue; // '2>&1' names no file
+          if (*target_count == MAX_TARGETS)
+            return true;
+          targets[(*target_count)++] = stage->redirects[r].target;
+        }
+        if (stage->args_count == 0)
+          continue;
+        char *word = stage->args[0];
+        if (stage->args_count > 2 && strcmp(word, "affinity") == 0)
+          word = stage->args[2]; // A prefix, it only pins the command after it
+        const struct builtin_entry *entry = find_builtin(word);
+        if (entry != NULL && entry->state)
+          return true;
+        if (entry != NULL)
+          continue; // Most likely runs in the worker without a lookup
+        // Warm the cache here, a lookup made inside a forked line would be thrown away
+        find_executable(word, paths, path_counter);
+      }
+    }
+  }
+  return false;
+}
+/*
+batch: the opened batch script
+name: how to refer to it in messages
+Returns the number of lines with a syntax error, each reported as name:line:column: message
+*/
+static size_t check_batch(struct batch_reader *batch, const char *name)
+{
+  const char *line;
+  size_t len;
+  size_t line_number = 0;
+  size_t errors = 0;
+  while ((line = batch_next(batch, &len)) != NULL)
+  {
+    line_number++;
+    char *string = batch_line(batch, line, len);
+    struct line_ast ast;
+    struct parse_error error;
+    if (string != NULL && !parse_line(string, &ast, &error))
+    {
+      fprintf(stderr, "%s:%zu:%zu: %s\n", name, line_number, error.position + 1, error.message);
+      errors++;
+    }
+    arena_reset(&line_arena);
+  }
+  return errors;
+}
+/*
+magic, version: COMPILED_MAGIC and COMPILED_VERSION, bumped whenever the format changes
+layout: sizes of the AST structs, whose pointers are stored as file offsets; a build where
+they differ parses the script instead
+source_size, source_hash: the script it was compiled from, its FNV-1a hash is checked on
+every load; a copy, a touch or an edit that keeps the size and mtime all look alike
+path_stamp: PATH directories and their mtimes when the executables were resolved
+line_count, lines: one offset per script line, of its struct line_ast; COMPILED_BLANK or
+COMPILED_ERROR for lines with nothing to run
+resolved_count, resolved: pairs of string offsets, a command name and where it was found
+*/
+struct compiled_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;
+  uint64_t source_size;
+  uint64_t source_hash;
+  uint64_t path_stamp;
+  uint64_t line_count;
+  uint64_t lines;
+  uint64_t resolved_count;
+  uint64_t resolved;
+};
+#define COMPILED_MAGIC "WISHC\r\n"
+#define COMPILED_VERSION 3 // 2: struct stage has executable, 3: no source mtime
+#define COMPILED_LAYOUT ((uint32_t)(sizeof(struct group) << 24 | sizeof(struct command) << 16 | sizeof(struct stage) << 8 | sizeof(struct redirect)))
+#define COMPILED_BLANK 0
+#define COMPILED_ERROR 1
+/*
+data, len, size: the file being built, malloc'd
+failed: out of memory, nothing is written
+*/
+struct compiled_writer
+{
+  char *data;
+  size_t len;
+  size_t size;
+  bool failed;
+};
+/*
+map, len: the compiled script, mapped private and writable so pointers are fixed up in place
+lines, line_count: from the header, each one a ready struct line_ast or a marker
+claimed: while loading, one bit per 8 bytes of the file fixed up in place, so no two nodes
+(two lines included) share any memory; NULL once loaded
+*/
+struct compiled
+{
+  char *map;
+  size_t len;
+  uint64_t *lines;
+  uint64_t line_count;
+  uint64_t *claimed;
+};
+/*
+writer: the file being built
+data, size: what to append
+align: its alignment, 1 for strings
+Returns its offset in the file
+*/
+static uint64_t compiled_emit(struct compiled_writer *writer, const void *data, size_t size, size_t align)
+{
+  size_t offset = (writer->len + align - 1) & ~(align - 1);
+  if (offset + size > writer->size)
+  {
+    size_t new_size = writer->size == 0 ? 65536 : writer->size;
+    while (new_size < offset + size)
+      new_size *= 2;
+    char *grown = realloc(writer->data, new_size);
+    if (grown == NULL)
+    {
+      writer->failed = true;
+      return 0;
+    }
+    writer->data = grown;
+    writer->size = new_size;
+  }
+  memset(writer->data + writer->len, 0, offset - writer->len); // Padding, keeps the file reproducible
+  memcpy(writer->data + offset, data, size);
+  writer->len = offset + size;
+  return offset;
+}
+// Function to append a string and get its offset as a pointer-sized field
+static char *compiled_string(struct compiled_writer *writer, const char *string)
+{
+  return (char *)(uintptr_t)compiled_emit(writer, string, strlen(string) + 1, 1);
+}
+/*
+writer: the file being built
+ast: a parsed line, in line_arena
+Returns the offset of its copy, every pointer in it turned into an offset
+*/
+static uint64_t compiled_line(struct compiled_writer *writer, struct line_ast *ast)
+{
+  int g, c, st, i;
+  for (g = 0; g < ast->group_count; g++)
+  {
+    struct group *group = &ast->groups[g];
+    for (c = 0; c < group->command_count; c++)
+    {
+      struct command *command = &group->commands[c];
+      for (st = 0; st < command->stage_count; st++)
+      {
+        struct stage *stage = &command->stages[st];
+        for (i = 0; i < stage->args_count; i++)
+          stage->args[i] = compiled_string(writer, stage->args[i]);
+        for (i = 0; i < stage->redirect_count; i++)
+        {
+          if (stage->redirects[i].target != NULL)
+            stage->redirects[i].target = compiled_string(writer, stage->redirects[i].target);
+        }
+        if (stage->executable != NULL)
+          stage->executable = compiled_string(writer, stage->executable);
+        // args[args_count] stays NULL, offset 0 is the header so it can't be confused
+        stage->args = (char **)(uintptr_t)compiled_emit(writer, stage->args, (stage->args_count + 1) * sizeof(char *), sizeof(char *));
+        if (stage->redirect_count > 0)
+          stage->redirects = (struct redirect *)(uintptr_t)compiled_emit(writer, stage->redirects, stage->redirect_count * sizeof(struct redirect), sizeof(void *));
+      }
+      command->stages = (struct stage *)(uintptr_t)compiled_emit(writer, command->stages, command->stage_count * sizeof(struct stage), sizeof(void *));
+    }
+    group->commands = (struct command *)(uintptr_t)compiled_emit(writer, group->commands, group->command_count * sizeof(struct command), sizeof(void *));
+  }
+  if (ast->group_count > 0)
+    ast->groups = (struct group *)(uintptr_t)compiled_emit(writer, ast->groups, ast->group_count * sizeof(struct group), sizeof(void *));
+  return compiled_emit(writer, ast, sizeof(*ast), sizeof(void *));
+}
+// Function to fingerprint the PATH directories, resolved paths are only reused while it matches
+static uint64_t compiled_path_stamp(char *paths[], size_t *path_counter)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < *path_counter; i++)
+  {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    stat(paths[i], &st);
+    h = memo_hash(h, paths[i], strlen(paths[i]) + 1);
+    h = memo_hash(h, (const char *)&st.st_mtim, sizeof(st.st_mtim));
+  }
+  return h;
+}
+/*
+batch: the opened batch script, mapped
+name: its file name, the compiled form goes to name.wishc
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Parses every line, reporting errors like -n does, resolves the commands, and writes the
+compiled form through a temp file and rename() so a reader never sees half of it
+Returns the number of lines with a syntax error, -1 if it couldn't be written
+*/
+static long compile_batch(struct batch_reader *batch, const char *name, char *paths[], size_t *path_counter)
+{
+  struct compiled_writer writer = {NULL, 0, 0, false};
+  struct compiled_header header;
+  if (batch->map == NULL)
+    return -1; // Only a regular file can be recognized again
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+  header.version = COMPILED_VERSION;
+  header.layout = COMPILED_LAYOUT;
+  header.source_size = batch->map_len;
+  header.source_hash = memo_hash(14695981039346656037ULL, batch->map, batch->map_len);
+  header.path_stamp = compiled_path_stamp(paths, path_counter);
+  compiled_emit(&writer, &header, sizeof(header), 8);
+  uint64_t *lines = NULL;
+  size_t capacity = 0;
+  const char *line;
+  size_t len;
+  long errors = 0;
+  while ((line = batch_next(batch, &len)) != NULL)
+  {
+    if (header.line_count == capacity)
+    {
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      uint64_t *grown = realloc(lines, capacity * sizeof(uint64_t));
+      if (grown == NULL)
+        writer.failed = true;
+      else
+        lines = grown;
+    }
+    if (writer.failed)
+      break;
+    uint64_t *entry = &lines[header.line_count++];
+    char *string = blank_line(line, len) ? NULL : batch_line(batch, line, len);
+    struct line_ast ast;
+    struct parse_error error;
+    *entry = COMPILED_BLANK;
+    if (string != NULL && !parse_line(string, &ast, &error))
+    {
+      fprintf(stderr, "%s:%llu:%zu: %s\n", name, (unsigned long long)header.line_count, error.position + 1, error.message);
+      errors++;
+      *entry = COMPILED_ERROR; // Reported again, the usual way, when it is run
+    }
+    else if (string != NULL)
+    {
+      int g, c, st;
+      for (g = 0; g < ast.group_count; g++)
+        for (c = 0; c < ast.groups[g].command_count; c++)
+          for (st = 0; st < ast.groups[g].commands[c].stage_count; st++)
+          {
+            char **args = ast.groups[g].commands[c].stages[st].args;
+            if (args[0] != NULL && find_builtin(args[0]) == NULL)
+              find_executable(args[0], paths, path_counter); // Lands in the cache, written out below
+          }
+      *entry = compiled_line(&writer, &ast);
+    }
+    arena_reset(&line_arena);
+  }
+  header.lines = compiled_emit(&writer, lines, header.line_count * sizeof(uint64_t), 8);
+  free(lines);
+  size_t i;
+  for (i = 0; i < command_hash.size; i++)
+  {
+    if (command_hash.entries[i].name == NULL)
+      continue;
+    char *pair[2] = {compiled_string(&writer, command_hash.entries[i].name), compiled_string(&writer, command_hash.entries[i].full_path)};
+    uint64_t offset = compiled_emit(&writer, pair, sizeof(pair), sizeof(char *));
+    if (header.resolved_count++ == 0)
+      header.resolved = offset; // Pairs are emitted back to back, pointer aligned
+  }
+  compiled_emit(&writer, "", 1, 1); // Ends in '\0', so no string can run off the end
+  char target[MAX_PATH_LENGTH], temp[MAX_PATH_LENGTH + 16];
+  snprintf(target, sizeof(target), "%s.wishc", name);
+  snprintf(temp, sizeof(temp), "%s.%d", target, (int)getpid());
+  int fd = writer.failed ? -1 : open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd >= 0)
+  {
+    memcpy(writer.data, &header, sizeof(header));
+    write_all(fd, writer.data, writer.len);
+    if (close(fd) != 0 || rename(temp, target) != 0)
+    {
+      unlink(temp);
+      fd = -1;
+    }
+  }
+  free(writer.data);
+  return fd < 0 ? -1 : errors;
+}
+/*
+compiled: the file being loaded
+offset, size: a node that is about to be fixed up in place
+Returns false if it isn't aligned like compiled_emit aligns nodes, or another node already
+has any of its bytes
+*/
+static bool compiled_claim(struct compiled *compiled, uint64_t offset, size_t size)
+{
+  if (offset % sizeof(void *) != 0)
+    return false;
+  uint64_t word;
+  for (word = offset / 8; word < (offset + size + 7) / 8; word++)
+  {
+    if (compiled->claimed[word / 64] & (1ULL << (word % 64)))
+      return false;
+    compiled->claimed[word / 64] |= 1ULL << (word % 64);
+  }
+  return true;
+}
+/*
+compiled: the mapped file
+field: address of a pointer field holding an offset
+size: bytes the pointer must have behind it
+node: it points at an array fixed up in turn, which compiled_claim has to grant; false for
+a string, which is only read
+Returns false if the offset is outside the file, or the node is misaligned or shared
+*/
+static bool compiled_relocate(struct compiled *compiled, void *field, size_t size, bool node)
+{
+  uintptr_t offset;
+  memcpy(&offset, field, sizeof(offset));
+  if (offset == 0 || offset > compiled->len || size > compiled->len - offset || (node && !compiled_claim(compiled, offset, size)))
+    return false;
+  void *pointer = compiled->map + offset;
+  memcpy(field, &pointer, sizeof(pointer));
+  return true;
+}
+// Function to turn every offset of one compiled line into a pointer, false if any is out of range, misaligned or shared
+static bool compiled_fixup(struct compiled *compiled, struct line_ast *ast)
+{
+  int g, c, st, i;
+  if (ast->group_count < 0 || (ast->group_count > 0 && !compiled_relocate(compiled, &ast->groups, ast->group_count * sizeof(struct group), true)))
+    return false;
+  for (g = 0; g < ast->group_count; g++)
+  {
+    struct group *group = &ast->groups[g];
+    if (group->command_count <= 0 || !compiled_relocate(compiled, &group->commands, group->command_count * sizeof(struct command), true))
+      return false;
+    for (c = 0; c < group->command_count; c++)
+    {
+      struct command *command = &group->commands[c];
+      if (command->stage_count <= 0 || !compiled_relocate(compiled, &command->stages, command->stage_count * sizeof(struct stage), true))
+        return false;
+      for (st = 0; st < command->stage_count; st++)
+      {
+        struct stage *stage = &command->stages[st];
+        if (stage->args_count < 0 || !compiled_relocate(compiled, &stage->args, (stage->args_count + 1) * sizeof(char *), true) || stage->args[stage->args_count] != NULL)
+          return false; // execv and the builtins go by the terminator, not args_count
+        if (stage->redirect_count < 0 || (stage->redirect_count > 0 && !compiled_relocate(compiled, &stage->redirects, stage->redirect_count * sizeof(struct redirect), true)))
+          return false;
+        for (i = 0; i < stage->args_count; i++)
+        {
+          if (!compiled_relocate(compiled, &stage->args[i], 1, false))
+            return false;
+        }
+        for (i = 0; i < stage->redirect_count; i++)
+        {
+          if (stage->redirects[i].target != NULL && !compiled_relocate(compiled, &stage->redirects[i].target, 1, false))
+            return false;
+        }
+        if (stage->executable != NULL && !compiled_relocate(compiled, &stage->executable, 1, false))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+/*
+compiled: receives the mapped, ready to run form
+batch: the opened batch script, mapped
+name: its file name
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Loads name.wishc if it was compiled from this very script, fixes it up in place and puts
+the resolved executables in the command cache when PATH hasn't changed since
+Returns false when the script has to be parsed as usual
+*/
+static bool compiled_open(struct compiled *compiled, struct batch_reader *batch, const char *name, char *paths[], size_t *path_counter)
+{
+  char target[MAX_PATH_LENGTH];
+  struct stat st;
+  snprintf(target, sizeof(target), "%s.wishc", name);
+  int fd = batch->map == NULL ? -1 : open(target, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  compiled->map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(struct compiled_header))
+    compiled->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); // Copy on write, only the nodes get touched
+  close(fd);
+  if (compiled->map == MAP_FAILED)
+    return false;
+  compiled->len = st.st_size;
+  compiled->claimed = calloc((compiled->len / 8 + 63) / 64 + 1, sizeof(uint64_t));
+  struct compiled_header *header = (struct compiled_header *)compiled->map;
+  // The hash too, every time: the file is trusted with pointers, size and mtime prove nothing
+  bool valid = compiled->claimed != NULL && memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) == 0 && header->version == COMPILED_VERSION &&
+               header->layout == COMPILED_LAYOUT && header->source_size == batch->map_len && compiled->map[compiled->len - 1] == '\0' &&
+               header->lines <= compiled->len && header->line_count <= (compiled->len - header->lines) / sizeof(uint64_t) &&
+               header->source_hash == memo_hash(14695981039346656037ULL, batch->map, batch->map_len);
+  // The header and the line table are read while the lines are fixed up, no node may overlap them
+  valid = valid && compiled_claim(compiled, 0, sizeof(struct compiled_header)) && compiled_claim(compiled, header->lines, header->line_count * sizeof(uint64_t));
+  compiled->lines = (uint64_t *)(compiled->map + header->lines);
+  compiled->line_count = header->line_count;
+  uint64_t i;
+  for (i = 0; valid && i < compiled->line_count; i++)
+  {
+    uint64_t offset = compiled->lines[i];
+    if (offset == COMPILED_BLANK || offset == COMPILED_ERROR)
+      continue;
+    // Two lines sharing one offset would be fixed up twice, the claim catches that as well
+    valid = offset <= compiled->len - sizeof(struct line_ast) && compiled_claim(compiled, offset, sizeof(struct line_ast)) &&
+            compiled_fixup(compiled, (struct line_ast *)(compiled->map + offset));
+  }
+  if (valid && header->path_stamp == compiled_path_stamp(paths, path_counter) && header->resolved <= compiled->len &&
+      header->resolved_count <= (compiled->len - header->resolved) / (2 * sizeof(char *)) &&
+      compiled_claim(compiled, header->resolved, header->resolved_count * 2 * sizeof(char *)))
+  {
+    hash_check_dirs(paths, path_counter); // Snapshot the directories first, or the first lookup flushes what is added
+    char **pairs = (char **)(compiled->map + header->resolved);
+    for (i = 0; i < header->resolved_count; i++)
+    {
+      if (compiled_relocate(compiled, &pairs[2 * i], 1, false) && compiled_relocate(compiled, &pairs[2 * i + 1], 1, false) &&
+          (command_hash.size == 0 || hash_slot(pairs[2 * i])->name == NULL))
+        hash_insert(pairs[2 * i], pairs[2 * i + 1]);
+    }
+  }
+  free(compiled->claimed);
+  compiled->claimed = NULL;
+  if (!valid)
+  {
+    munmap(compiled->map, compiled->len); // Whatever was fixed up so far goes with the private mapping
+    return false;
+  }
+  return true;
+}
+/*
+pid: the forked process running the line
+targets: its '>' files, pointing into names
+target_count: number of targets
+names, names_size: storage for the target names, reused from line to line
+started, text: when and what, for --stats
+*/
+struct batch_worker
+{
+  pid_t pid;
+  char *targets[MAX_TARGETS];
+  int target_count;
+  char *names;
+  size_t names_size;
+  struct timespec started;
+  char text[STATS_TEXT];
+};
+/*
+workers: lines in flight
+worker_count: number of workers
+failed: incremented for every line that exits non zero
+Returns false if there was nothing to reap
+*/
+static bool reap_worker(struct batch_worker workers[], int *worker_count, size_t *failed)
+{
+  int wstatus;
+  struct rusage usage; // The worker and every command it reaped
+  pid_t pid = reap_any(&wstatus, &usage);
+  if (pid < 0)
+    return false;
+  int i;
+  for (i = 0; i < *worker_count && workers[i].pid != pid; i++)
+    ;
+  if (i == *worker_count)
+    background_reaped(pid, wstatus); // A zygote or an '&' job of a fence line
+  for (; i < *worker_count; i++)
+  {
+    if (workers[i].pid != pid)
+      continue;
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+      (*failed)++;
+    if (options.stats)
+    {
+      // The commands ran in the worker, here the whole line is the unit
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double wall = timespec_seconds(workers[i].started, now);
+      stats_record(workers[i].text, wall, timeval_seconds(usage.ru_utime), timeval_seconds(usage.ru_stime), usage.ru_maxrss,
+                   WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1);
+      stats_line(wall, false);
+    }
+    // Swap with the last one, order does not matter and the name buffers stay owned
+    struct batch_worker done = workers[i];
+    workers[i] = workers[--(*worker_count)];
+    workers[*worker_count] = done;
+    break;
+  }
+  return true;
+}
+/*
+batch: the opened batch script
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Runs up to options.batch_jobs lines at once, each in a forked copy of the shell.
+Lines that change shell state and 'wait' lines are fences: everything before them finishes,
+then they run in the shell itself. Lines writing to a '>' file still in use wait for that line.
+An 'exit' line ends the script once the lines before it are done.
+Returns 1 if any line failed, 0 otherwise
+*/
+static int run_batch_parallel(struct batch_reader *batch, char *paths[], size_t *path_counter)
+{
+  struct batch_worker *workers = calloc(options.batch_jobs, sizeof(struct batch_worker));
+  int worker_count = 0;
+  size_t lines = 0;
+  size_t failed = 0;
+  char *copy = NULL;
+  size_t copy_len = 0;
+  const char *line;
+  size_t len;
+  if (workers == NULL)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1; // Nothing ran, the caller still closes the script
+  }
+
+  while ((line = batch_next(batch, &len)) != NULL)
+  {
+    stats.line_number++;
+    if (blank_line(line, len))
+      continue; // Blank line, nothing to schedule
+    lines++;
+    char *string = batch_line(batch, line, len);
+    if (string != NULL && copy_len < len + 1)
+    {
+      char *grown = realloc(copy, len + 1);
+      if (grown == NULL)
+        string = NULL;
+      else
+      {
+        copy = grown;
+        copy_len = len + 1;
+      }
+    }
+    if (string == NULL)
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message)); // Out of memory: fail this line, go on
+      failed++;
+      continue;
+    }
+    memcpy(copy, string, len + 1);
+    char *targets[MAX_TARGETS];
+    int target_count;
+    if (scan_line(copy, targets, &target_count, paths, path_counter))
+    {
+      while (worker_count > 0 && reap_worker(workers, &worker_count, &failed))
+        ; // Fence: drain every line before it; idle zygotes never exit, so count, don't wait for ECHILD
+      if (process_line(string, paths, path_counter, false) != 0)
+        failed++;
+      if (embedding.exiting)
+        break; // After the lines before it, like everywhere else
+      continue;
+    }
+    // Same output file as a line still running: let that one finish first
+    int i = 0;
+    while (i < worker_count)
+    {
+      bool clash = false;
+      int t, u;
+      for (t = 0; t < target_count && !clash; t++)
+        for (u = 0; u < workers[i].target_count && !clash; u++)
+          clash = strcmp(targets[t], workers[i].targets[u]) == 0;
+      if (!clash)
+      {
+        i++;
+        continue;
+      }
+      pid_t blocker = workers[i].pid;
+      while (worker_count > 0 && reap_worker(workers, &worker_count, &failed))
+      {
+        int w;
+        for (w = 0; w < worker_count && workers[w].pid != blocker; w++)
+          ;
+        if (w == worker_count)
+          break; // The clashing line is done
+      }
+      i = 0; // The table was reshuffled, look again
+    }
+    while (worker_count >= options.batch_jobs && reap_worker(workers, &worker_count, &failed))
+      ;
+    fflush(stdout); // Don't let the child inherit buffered output
+    pid_t pid = own_reserve() ? fork() : -1;
+    if (pid == 0)
+    {
+      trace_after_fork();
+      events_after_fork();
+      prefork_after_fork();
+      int status = process_line(string, paths, path_counter, false);
+      fflush(stdout);
+      trace_flush();
+      _exit(status); // Nothing to clean up that the parent doesn't own
+    }
+    else if (pid < 0)
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      failed++;
+      continue;
+    }
+    own.pids[own.count++] = pid;
+    struct batch_worker *worker = &workers[worker_count++];
+    worker->pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &worker->started);
+    snprintf(worker->text, sizeof(worker->text), "%.*s", (int)len, line);
+    worker->target_count = 0;
+    size_t needed = 0;
+    for (i = 0; i < target_count; i++)
+      needed += strlen(targets[i]) + 1;
+    if (worker->names_size < needed)
+    {
+      free(worker->names);
+      worker->names = malloc(needed);
+      worker->names_size = worker->names == NULL ? 0 : needed;
+    }
+    char *name = worker->names;
+    for (i = 0; i < target_count && worker->names != NULL; i++)
+    {
+      strcpy(name, targets[i]);
+      worker->targets[worker->target_count++] = name;
+      name += strlen(name) + 1;
+    }
+    arena_reset(&line_arena); // The lookups scan_line made
+  }
+  while (worker_count > 0 && reap_worker(workers, &worker_count, &failed))
+    ;
+  fprintf(stderr, "batch: %zu lines, %zu succeeded, %zu failed\n", lines, lines - failed, failed);
+  if (options.stats)
+    stats_batch();
+  int w;
+  for (w = 0; w < options.batch_jobs; w++)
+    free(workers[w].names);
+  free(copy);
+  free(workers);
+  return failed > 0 ? 1 : 0;
+}
+
+/*
+arena: holds the line's text and its AST, reset when the slot comes around again
+ast: the parsed line
+line_number: the script line it came from, blank lines are skipped by the parser thread
+stamp: dirs_stamp of the PATH directories its commands were resolved against
+error: the line didn't parse, report it when its turn comes
+end: no more lines
+*/
+struct ahead_slot
+{
+  struct arena arena;
+  struct line_ast ast;
+  size_t line_number;
+  uint64_t stamp;
+  bool error;
+  bool end;
+};
+/*
+slots, size: the ring, one producer (the parser thread) and one consumer (the shell)
+head: slots published by the parser, only it writes it
+tail: slots given back by the shell, only it writes it
+parser_waiting, shell_waiting: set before sleeping on a futex so the other side wakes it,
+only when that is needed
+stop: set by the shell after exit, the parser quits instead of reading on
+batch: the script, read by the parser thread alone once it runs
+paths, path_counter: the parser's own copy of PATH, following the 'path' lines it parses
+resolve: false once a 'cd' could change what relative PATH entries mean
+cache: the parser's own lookups, the shell's cache isn't shared across threads
+dir_mtime, checked: like the shell's cache, it is dropped when a PATH directory changes
+*/
+struct read_ahead
+{
+  struct ahead_slot *slots;
+  uint32_t size;
+  uint32_t head;
+  uint32_t tail;
+  int parser_waiting;
+  int shell_waiting;
+  int stop;
+  struct batch_reader *batch;
+  char *paths[MAX_PATH];
+  size_t path_counter;
+  bool resolve;
+  struct
+  {
+    char *name;
+    char *full_path;
+  } cache[64];
+  struct timespec dir_mtime[MAX_PATH];
+  struct timespec checked;
+};
+// Function to sleep until *word is no longer value, or a spurious wakeup
+static void ahead_wait(uint32_t *word, uint32_t value, int *waiting)
+{
+  __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == value)
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+  __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+/*
+word, value: publish the new value of head or tail
+waiting: the other side's flag
+wake: whether it is worth waking it now if it sleeps
+*/
+static void ahead_post(uint32_t *word, uint32_t value, int *waiting, bool wake)
+{
+  __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+  if (wake && __atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+// Function to forget the parser's lookups, its PATH or one of the directories changed
+static void ahead_forget(struct read_ahead *ahead)
+{
+  int i;
+  for (i = 0; i < 64; i++)
+  {
+    free(ahead->cache[i].name);
+    free(ahead->cache[i].full_path);
+    ahead->cache[i].name = ahead->cache[i].full_path = NULL;
+  }
+}
+/*
+ahead: the parser's state
+name: a command name
+Returns where it is found in the parser's PATH copy, in line_arena, or NULL to leave it to
+the shell's own lookup
+*/
+static char *ahead_resolve(struct read_ahead *ahead, const char *name)
+{
+  if (!ahead->resolve || find_builtin(name) != NULL)
+    return NULL;
+  if (dirs_changed(ahead->paths, ahead->path_counter, ahead->dir_mtime, &ahead->checked))
+    ahead_forget(ahead); // A command was added or removed, maybe ahead of the one cached
+  size_t slot = hash_string(name) & 63;
+  if (ahead->cache[slot].name != NULL && strcmp(ahead->cache[slot].name, name) == 0)
+    return arena_strdup(&line_arena, ahead->cache[slot].full_path); // The slot's copy, the cache entry may be replaced meanwhile
+  char full_path[MAX_PATH_LENGTH];
+  size_t i;
+  for (i = 0; i < ahead->path_counter; i++)
+  {
+    snprintf(full_path, sizeof(full_path), "%s/%s", ahead->paths[i], name);
+    if (access(full_path, X_OK) != 0)
+      continue;
+    free(ahead->cache[slot].name);
+    free(ahead->cache[slot].full_path);
+    ahead->cache[slot].name = strdup(name);
+    ahead->cache[slot].full_path = strdup(full_path);
+    return ahead->cache[slot].full_path == NULL ? NULL : arena_strdup(&line_arena, full_path);
+  }
+  return NULL;
+}
+/*
+ahead: the parser's state
+ast: a line just parsed
+Fills in stage->executable, and follows 'path' and 'cd' so later lines are resolved the way
+the shell will see them
+*/
+static void ahead_lookups(struct read_ahead *ahead, struct line_ast *ast)
+{
+  int g, c, st;
+  for (g = 0; g < ast->group_count; g++)
+  {
+    for (c = 0; c < ast->groups[g].command_count; c++)
+    {
+      struct command *command = &ast->groups[g].commands[c];
+      for (st = 0; st < command->stage_count; st++)
+      {
+        struct stage *stage = &command->stages[st];
+        char **args = stage->args;
+        if (stage->args_count == 0)
+          continue;
+        if (st == 0 && stage->args_count > 1 && strcmp(args[0], "time") == 0)
+          args++; // The shell drops the prefix before launching
+        if (st == 0 && stage->args_count > (args - stage->args) + 2 && strcmp(args[0], "affinity") == 0)
+          args += 2; // And this one
+        if (strcmp(args[0], "path") == 0)
+        {
+          clear_path(ahead->paths, &ahead->path_counter);
+          ahead_forget(ahead);
+          ahead->checked = (struct timespec){0, 0}; // The new directories are looked at on the next lookup
+          int i;
+          for (i = 1; i < stage->args_count && ahead->path_counter < MAX_PATH; i++)
+            ahead->paths[ahead->path_counter++] = strdup(args[i]);
+        }
+        else if (strcmp(args[0], "cd") == 0)
+        {
+          size_t i;
+          for (i = 0; i < ahead->path_counter; i++)
+            ahead->resolve = ahead->resolve && ahead->paths[i][0] == '/';
+        }
+        else
+        {
+          stage->executable = ahead_resolve(ahead, args[0]);
+        }
+      }
+    }
+  }
+}
+// Function to drop what the parser resolved for a line, the shell looks the commands up itself
+static void ahead_unresolve(struct line_ast *ast)
+{
+  int g, c, st;
+  for (g = 0; g < ast->group_count; g++)
+    for (c = 0; c < ast->groups[g].command_count; c++)
+      for (st = 0; st < ast->groups[g].commands[c].stage_count; st++)
+        ast->groups[g].commands[c].stages[st].executable = NULL;
+}
+// Function run by the parser thread: read, parse and resolve lines into the ring until the script ends
+static void *ahead_parser(void *data)
+{
+  struct read_ahead *ahead = data;
+  size_t line_number = 0;
+  const char *line;
+  size_t len;
+  uint32_t head = 0;
+  while (1)
+  {
+    uint32_t tail = __atomic_load_n(&ahead->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ahead->size)
+    {
+      // Far enough ahead: sleep until half the ring is free, not once per line
+      while (head - tail > ahead->size / 2 && !__atomic_load_n(&ahead->stop, __ATOMIC_ACQUIRE))
+      {
+        ahead_wait(&ahead->tail, tail, &ahead->parser_waiting);
+        tail = __atomic_load_n(&ahead->tail, __ATOMIC_ACQUIRE);
+      }
+    }
+    if (__atomic_load_n(&ahead->stop, __ATOMIC_ACQUIRE))
+      return NULL;
+    struct ahead_slot *slot = &ahead->slots[head % ahead->size];
+    while ((line = batch_next(ahead->batch, &len)) != NULL && blank_line(line, len))
+      line_number++;
+    line_number++;
+    arena_reset(&slot->arena);
+    line_arena = slot->arena; // This thread's line_arena, parse_line allocates from it
+    slot->end = line == NULL;
+    slot->line_number = line_number;
+    if (line != NULL)
+    {
+      char *string = arena_alloc(&line_arena, len + 1);
+      struct parse_error error;
+      slot->error = string == NULL;
+      if (string != NULL)
+      {
+        memcpy(string, line, len);
+        string[len] = '\0';
+        slot->error = !parse_line(string, &slot->ast, &error);
+      }
+      if (!slot->error)
+        ahead_lookups(ahead, &slot->ast);
+      slot->stamp = dirs_stamp(ahead->dir_mtime, ahead->path_counter);
+    }
+    slot->arena = line_arena;
+    ahead_post(&ahead->head, ++head, &ahead->shell_waiting, true); // The shell only sleeps when it has nothing to run
+    if (slot->end)
+      return NULL;
+  }
+}
+/*
+batch: the opened batch script
+paths: all the potential paths (could be invalid)
+path_counter: number of paths
+Runs the script in order like the plain loop, while a parser thread stays up to
+options.read_ahead lines ahead, so the next line is parsed and resolved by the time the
+current one is reaped
+Returns false if the thread couldn't be started, nothing was run then
+*/
+static bool run_batch_ahead(struct batch_reader *batch, char *paths[], size_t *path_counter)
+{
+  struct read_ahead *ahead = calloc(1, sizeof(struct read_ahead));
+  if (ahead == NULL || (ahead->slots = calloc(options.read_ahead, sizeof(struct ahead_slot))) == NULL)
+  {
+    free(ahead);
+    return false;
+  }
+  ahead->size = options.read_ahead;
+  ahead->batch = batch;
+  ahead->resolve = true;
+  size_t i;
+  for (i = 0; i < *path_counter; i++)
+    ahead->paths[ahead->path_counter++] = strdup(paths[i]);
+  pthread_t thread;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old); // Signals are for the shell's thread, the parser inherits the mask
+  int rc = pthread_create(&thread, NULL, ahead_parser, ahead);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0)
+  {
+    clear_path(ahead->paths, &ahead->path_counter);
+    free(ahead->slots);
+    free(ahead);
+    return false;
+  }
+  uint32_t tail = 0;
+  while (1)
+  {
+    uint32_t head;
+    while ((head = __atomic_load_n(&ahead->head, __ATOMIC_ACQUIRE)) == tail)
+      ahead_wait(&ahead->head, head, &ahead->shell_waiting);
+    struct ahead_slot *slot = &ahead->slots[tail % ahead->size];
+    if (slot->end)
+      break;
+    stats.line_number = slot->line_number;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    hash_check_dirs(paths, path_counter);
+    if (!slot->error && slot->stamp != dirs_stamp(command_hash.dir_mtime, *path_counter))
+      ahead_unresolve(&slot->ast); // A directory changed since, or the parser hasn't noticed yet
+    if (slot->error)
+      write(STDERR_FILENO, error_message, strlen(error_message));
+    else
+      run_line(&slot->ast, paths, path_counter, false, started);
+    tail++;
+    if (embedding.exiting)
+    {
+      __atomic_store_n(&ahead->stop, 1, __ATOMIC_SEQ_CST);
+      ahead_post(&ahead->tail, tail, &ahead->parser_waiting, true); // A new tail, so a parser about to sleep doesn't
+      break;
+    }
+    ahead_post(&ahead->tail, tail, &ahead->parser_waiting, head - tail <= ahead->size / 2);
+  }
+  pthread_join(thread, NULL);
+  ahead_forget(ahead);
+  clear_path(ahead->paths, &ahead->path_counter);
+  for (i = 0; i < ahead->size; i++)
+  {
+    struct arena_chunk *chunk = ahead->slots[i].arena.first;
+    while (chunk != NULL)
+    {
+      struct arena_chunk *next = chunk->next;
+      free(chunk);
+      chunk = next;
+    }
+  }
+  free(ahead->slots);
+  free(ahead);
+  if (options.stats)
+    stats_batch();
+  return true;
+}
+/*
+options: how to launch, capture, trace..., NULL for the defaults
+Returns false if the trace file or the memo directory can't be opened
+*/
+bool wish_init(const struct shell_options *given)
+{
+  if (given != NULL)
+    options = *given;
+  const char *trace = options.trace != NULL ? options.trace : getenv("WISH_TRACE");
+  if (trace != NULL && !trace_open(trace))
+    return false;
+  // Replays results of commands declared with the pure builtin
+  if (options.memo != NULL && ((mkdir(options.memo, 0755) != 0 && errno != EEXIST) || (memo.dir = open(options.memo, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0))
+    return false;
+  events_init();
+  if (options.max_jobs == 0)
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options.max_jobs = cpus > 0 ? (int)cpus : 1;
+  }
+  return true;
+}
+// Function to make a handle, in the current directory with a PATH of /bin; NULL if out of memory
+struct wish *wish_new(void)
+{
+  struct wish *shell = calloc(1, sizeof(struct wish));
+  if (shell == NULL)
+    return NULL;
+  shell->paths[0] = strdup("/bin");
+  shell->path_counter = 1;
+  shell->cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (shell->paths[0] == NULL || shell->cwd < 0)
+  {
+    wish_free(shell);
+    return NULL;
+  }
+  return shell;
+}
+// Function to drop a handle with its PATH and command cache
+void wish_free(struct wish *shell)
+{
+  if (embedding.active == shell)
+  {
+    hash_clear();
+    free(command_hash.entries);
+    memset(&command_hash, 0, sizeof(command_hash));
+    embedding.active = NULL;
+  }
+  else
+  {
+    size_t i;
+    for (i = 0; i < shell->hash.size; i++)
+    {
+      free(shell->hash.entries[i].name);
+      free(shell->hash.entries[i].full_path);
+    }
+    free(shell->hash.entries);
+  }
+  clear_path(shell->paths, &shell->path_counter);
+  if (shell->cwd >= 0)
+    close(shell->cwd);
+  free(shell);
+}
+// Function to put shell's command cache in place of the previous handle's
+static void wish_activate(struct wish *shell)
+{
+  if (embedding.active == shell)
+    return;
+  if (embedding.active != NULL)
+    embedding.active->hash = command_hash;
+  command_hash = shell->hash;
+  embedding.active = shell;
+}
+// Function to move into shell's directory, returns the caller's to come back to
+static int wish_enter(struct wish *shell)
+{
+  int caller = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  wish_activate(shell);
+  fchdir(shell->cwd);
+  return caller;
+}
+// Function to go back to the caller's directory, remembering where shell's lines left it
+static void wish_leave(struct wish *shell, int caller, bool moved)
+{
+  if (moved)
+  {
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd >= 0)
+    {
+      close(shell->cwd);
+      shell->cwd = cwd;
+    }
+  }
+  if (caller >= 0)
+  {
+    fchdir(caller);
+    close(caller);
+  }
+}
+// Function to run a line in place, for an entered handle
+static int wish_line(struct wish *shell, const char *line, struct wish_result *result)
+{
+  size_t len = strlen(line);
+  char *string = arena_alloc(&line_arena, len + 1); // process_line cuts it up, and drops the arena
+  result->exited = false;
+  if (string == NULL)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    result->status = 1;
+    return 1;
+  }
+  memcpy(string, line, len + 1);
+  embedding.running = true;
+  embedding.exiting = false;
+  result->status = process_line(string, shell->paths, &shell->path_counter, false);
+  result->exited = embedding.exiting;
+  embedding.running = false;
+  fflush(stdout);
+  return result->status;
+}
+/*
+shell: whose PATH, cwd and command cache the line uses, cd and path change them
+line: one command line, without its newline
+result: receives its status
+Runs the line to completion, with the process's stdin, stdout and stderr; exit only sets
+result->exited
+Returns the status
+*/
+int wish_run(struct wish *shell, const char *line, struct wish_result *result)
+{
+  int caller = wish_enter(shell);
+  wish_line(shell, line, result);
+  wish_leave(shell, caller, true);
+  return result->status;
+}
+/*
+shell, line: as for wish_run()
+result: receives the status of a line that ran in place
+Forks a copy of the shell to run the line, like -j does, so the caller can go on
+Returns a pidfd for poll() and wish_wait(), or -1 once the line is over, result->status
+telling how it went: one that changes the handle itself (cd, path...), doesn't parse or is
+blank ran in place, and without pidfds the forked copy is waited for
+*/
+int wish_start(struct wish *shell, const char *line, struct wish_result *result)
+{
+  size_t len = strlen(line);
+  result->status = 0;
+  result->exited = false;
+  if (blank_line(line, len))
+    return -1;
+  int caller = wish_enter(shell);
+  char *copy = arena_alloc(&line_arena, len + 1);
+  if (copy != NULL)
+    memcpy(copy, line, len + 1);
+  char *targets[MAX_TARGETS];
+  int target_count;
+  // Also warms the cache; out of memory, it fails in place and wish_line reports it
+  if (copy == NULL || scan_line(copy, targets, &target_count, shell->paths, &shell->path_counter))
+  {
+    arena_reset(&line_arena);
+    wish_line(shell, line, result);
+    wish_leave(shell, caller, true);
+    return -1;
+  }
+  arena_reset(&line_arena);
+  struct wish_started *grown = realloc(embedding.started, (embedding.started_count + 1) * sizeof(struct wish_started));
+  if (grown == NULL)
+  {
+    wish_leave(shell, caller, false);
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    result->status = 1;
+    return -1;
+  }
+  embedding.started = grown;
+  fflush(stdout);
+  pid_t pid = own_reserve() ? fork() : -1;
+  if (pid == 0)
+  {
+    trace_after_fork();
+    events_after_fork();
+    prefork_after_fork();
+    char *string = arena_alloc(&line_arena, len + 1);
+    if (string == NULL)
+    {
+      write(STDERR_FILENO, error_message, strlen(error_message));
+      _exit(1);
+    }
+    memcpy(string, line, len + 1);
+    int status = process_line(string, shell->paths, &shell->path_counter, false);
+    fflush(stdout);
+    trace_flush();
+    _exit(status);
+  }
+  wish_leave(shell, caller, false);
+  if (pid < 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    result->status = 1;
+    return -1;
+  }
+  own.pids[own.count++] = pid;
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd < 0)
+  {
+    int wstatus;
+    int waited;
+    while ((waited = waitpid(pid, &wstatus, 0)) < 0 && errno == EINTR) // No pidfds, nothing to hand back: wait for the line here
+      ;
+    own_remove(pid);
+    if (waited < 0)
+      result->status = 1;
+    else
+      result->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    return -1;
+  }
+  embedding.started[embedding.started_count++] = (struct wish_started){pid, pidfd, false, 0};
+  return pidfd;
+}
+/*
+pidfd: from wish_start(), closed here
+result: receives the line's status
+Waits for the line to finish
+Returns its status, or -1 if pidfd didn't come from wish_start()
+*/
+int wish_wait(int pidfd, struct wish_result *result)
+{
+  int i;
+  for (i = 0; i < embedding.started_count && embedding.started[i].pidfd != pidfd; i++)
+    ;
+  if (i == embedding.started_count)
+    return -1;
+  struct wish_started *started = &embedding.started[i];
+  if (!started->done)
+  {
+    siginfo_t info;
+    int waited;
+    while ((waited = waitid(P_PIDFD, pidfd, &info, WEXITED)) != 0 && errno == EINTR)
+      ;
+    own_remove(started->pid);
+    if (waited != 0)
+      started->status = 1;
+    else
+      started->status = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+  }
+  result->status = started->status;
+  result->exited = false;
+  close(pidfd);
+  *started = embedding.started[--embedding.started_count];
+  return result->status;
+}
+/*
+shell: the handle to run the script with, its PATH and cwd are the shell's
+file: path of the batch script, "-" reads it from stdin
+Runs the script line by line, or checks or compiles it with -n and --compile
+Returns the exit status for the shell
+*/
+int wish_batch(struct wish *shell, const char *file)
+{
+  struct batch_reader batch;
+  struct compiled compiled;
+  char **paths = shell->paths;
+  size_t *path_counter = &shell->path_counter;
+  int status = 0;
+  wish_activate(shell);
+  fchdir(shell->cwd); // Not coming back, cd moves the shell itself from here on
+  if (!batch_open(&batch, file))
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  embedding.running = true; // exit ends the script, the summaries below still get written
+  embedding.exiting = false;
+  if (options.check_only)
+  {
+    size_t errors = check_batch(&batch, file);
+    status = errors > 0 ? 1 : 0;
+  }
+  else if (options.compile)
+  {
+    long errors = compile_batch(&batch, file, paths, path_counter);
+    if (errors < 0)
+      write(STDERR_FILENO, error_message, strlen(error_message));
+    status = errors != 0 ? 1 : 0;
+  }
+  else if (options.batch_jobs > 1)
+  {
+    status = run_batch_parallel(&batch, paths, path_counter);
+  }
+  else if (compiled_open(&compiled, &batch, file, paths, path_counter))
+  {
+    uint64_t i;
+    for (i = 0; i < compiled.line_count; i++) // Same as below, minus reading and parsing
+    {
+      stats.line_number++;
+      if (compiled.lines[i] == COMPILED_BLANK)
+        continue;
+      if (compiled.lines[i] == COMPILED_ERROR)
+      {
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        continue;
+      }
+      struct timespec started;
+      clock_gettime(CLOCK_MONOTONIC, &started);
+      run_line((struct line_ast *)(compiled.map + compiled.lines[i]), paths, path_counter, false, started);
+      if (embedding.exiting)
+        break;
+    }
+    if (options.stats)
+      stats_batch();
+  }
+  else if (options.read_ahead > 0 && options.launch != LAUNCH_FORK && run_batch_ahead(&batch, paths, path_counter)) // A fork child of a threaded process may only make async-signal-safe calls, not format its trace
+  {
+    // Done, every line went through the parser thread
+  }
+  else
+  {
+    const char *line;
+    size_t len;
+
+    while ((line = batch_next(&batch, &len)) != NULL) // For every line, treat it as an keyboard input + ENTER
+    {
+      stats.line_number++;
+      if (blank_line(line, len))
+        continue; // Nothing to tokenize, skip the copy
+      char *string = batch_line(&batch, line, len);
+      if (string == NULL)
+      {
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        status = 1;
+        break;
+      }
+      process_line(string, paths, path_counter, false);
+      if (embedding.exiting)
+        break;
+    }
+    if (options.stats)
+      stats_batch();
+  }
+  embedding.running = false;
+  batch_close(&batch);
+  return status;
+}
+/*
+shell: the handle to run the lines with
+Reads lines from stdin until end of file, reporting '&' jobs as they finish
+Returns the exit status for the shell
+*/
+int wish_interactive(struct wish *shell)
+{
+  char *input = NULL; // What read() brought in and wasn't run yet, grown as needed
+  size_t input_len = 0;
+  size_t input_size = 0;
+  char *line = NULL; // The line being run, process_line cuts it up
+  size_t line_size = 0;
+  bool eof = false;
+  int status = 0;
+  wish_activate(shell);
+  fchdir(shell->cwd);
+  events_watch_input();
+  while (1)
+  {
+    background_poll();
+    background_report(false);
+    fflush(stdout);
+    char *newline = input_len > 0 ? memchr(input, '\n', input_len) : NULL;
+    if (newline == NULL && !eof)
+    {
+      // Wait in the event loop rather than in read() so background jobs are reaped, and
+      // reported, as they finish; nothing to wait for while a whole line is buffered
+      while (events.input && !events_wait())
+      {
+        background_poll();
+        background_report(false);
+      }
+      if (input_size - input_len < BATCH_CHUNK)
+      {
+        char *grown = realloc(input, input_size + BATCH_CHUNK);
+        if (grown == NULL)
+        {
+          write(STDERR_FILENO, error_message, strlen(error_message));
+          status = 1;
+          break;
+        }
+        input = grown;
+        input_size += BATCH_CHUNK;
+      }
+      ssize_t got = read(STDIN_FILENO, input + input_len, input_size - input_len);
+      if (got < 0 && errno != EINTR)
+      {
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        status = 1;
+        break;
+      }
+      if (got == 0)
+        eof = true;
+      else if (got > 0)
+        input_len += got;
+      continue;
+    }
+    if (newline == NULL && input_len == 0)
+    {
+      printf("\n");
+      break;
+    }
+    size_t len = newline != NULL ? (size_t)(newline - input) + 1 : input_len; // The last line may lack its newline
+    if (line_size < len + 1)
+    {
+      char *grown = realloc(line, len + 1);
+      if (grown == NULL)
+      {
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        status = 1;
+        break;
+      }
+      line = grown;
+      line_size = len + 1;
+    }
+    memcpy(line, input, len);
+    line[len] = '\0';
+    input_len -= len;
+    memmove(input, input + len, input_len);
+    stats.line_number++;
+    process_line(line, shell->paths, &shell->path_counter, true);
+  }
+  free(input);
+  free(line);
+  return status;
+}
+/*
+fd: the client's socket, nonblocking, -1 for a free slot
+stdio: the client's stdin, stdout and stderr, passed with SCM_RIGHTS in its first message;
+-1 until that arrives
+shell: its own cwd, PATH and command cache
+input, input_len, input_size: what was received and not run yet, malloc'd
+output, output_len, output_size: replies the socket didn't take yet, sent on EPOLLOUT, malloc'd
+worker: pidfd of the process running its current line, -1 when idle
+midline: the current line has ';' groups left to run, they start one at a time
+status: of the current line's groups so far, replied once the last one is done
+exited: it ran exit, the connection is closed once the reply is sent
+*/
+struct connection
+{
+  int fd;
+  int stdio[3];
+  struct wish *shell;
+  char *input;
+  size_t input_len;
+  size_t input_size;
+  char *output;
+  size_t output_len;
+  size_t output_size;
+  int worker;
+  bool midline;
+  int status;
+  bool exited;
+};
+/*
+listen_fd: the --server socket
+epoll_fd: its own epoll: the socket, the clients, their workers and the SIGCHLD signalfd
+connections, connection_count: the clients, slots are reused
+*/
+struct server
+{
+  int listen_fd;
+  int epoll_fd;
+  struct connection **connections;
+  int connection_count;
+};
+static struct server server = {-1, -1, NULL, 0};
+// What a server epoll event is about: the socket, SIGCHLD, or a client's socket or worker by slot
+#define SERVER_LISTEN 0
+#define SERVER_CHILDREN 1
+#define SERVER_EVENT(slot, worker) (((uint64_t)(slot) + 1) << 1 | (worker))
+// Function to watch a client's socket for input, and for room to write while replies are queued
+static void server_watch(int slot)
+{
+  struct connection *connection = server.connections[slot];
+  struct epoll_event event = {connection->output_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN, {.u64 = SERVER_EVENT(slot, 0)}};
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+// Function to send what the socket takes of the queued replies, false if the client is gone
+static bool server_flush(int slot)
+{
+  struct connection *connection = server.connections[slot];
+  size_t sent = 0;
+  while (sent < connection->output_len)
+  {
+    ssize_t rc = send(connection->fd, connection->output + sent, connection->output_len - sent, MSG_NOSIGNAL);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && errno != EAGAIN)
+      return false;
+    if (rc < 0)
+      break; // Full, EPOLLOUT says when to go on
+    sent += rc;
+  }
+  connection->output_len -= sent;
+  memmove(connection->output, connection->output + sent, connection->output_len);
+  return true;
+}
+/*
+slot: the client
+status: how its line went
+Queues one "status\n" per line, "status exit\n" for the one that ran exit, and sends what the
+socket takes right away; never blocks on a slow reader
+*/
+static void server_reply(int slot, int status)
+{
+  struct connection *connection = server.connections[slot];
+  char reply[32];
+  int len = snprintf(reply, sizeof(reply), "%d%s\n", status, connection->exited ? " exit" : "");
+  if (connection->output_size - connection->output_len < (size_t)len)
+  {
+    size_t size = connection->output_size == 0 ? 256 : connection->output_size * 2;
+    char *grown = realloc(connection->output, size);
+    if (grown == NULL)
+    {
+      shutdown(connection->fd, SHUT_RDWR); // It would wait forever, hang up; the read side closes it
+      return;
+    }
+    connection->output = grown;
+    connection->output_size = size;
+  }
+  bool idle = connection->output_len == 0;
+  memcpy(connection->output + connection->output_len, reply, len);
+  connection->output_len += len;
+  if (!server_flush(slot))
+    shutdown(connection->fd, SHUT_RDWR);
+  else if (idle && connection->output_len > 0)
+    server_watch(slot); // Queued from now on, wait for room
+}
+// Function to drop a client and everything it held
+static void server_close(struct connection *connection)
+{
+  int i;
+  if (connection->worker >= 0)
+  {
+    struct wish_result result;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, connection->worker, NULL);
+    syscall(SYS_pidfd_send_signal, connection->worker, SIGTERM, NULL, 0); // Nobody to report to
+    wish_wait(connection->worker, &result);
+    connection->worker = -1;
+  }
+  // Workers forked meanwhile hold copies of the socket, closing it isn't enough
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  connection->fd = -1;
+  for (i = 0; i < 3; i++)
+  {
+    if (connection->stdio[i] >= 0)
+      close(connection->stdio[i]);
+  }
+  wish_free(connection->shell);
+  free(connection->input);
+  free(connection->output);
+  connection->input = connection->output = NULL;
+  connection->input_len = connection->input_size = 0;
+  connection->output_len = connection->output_size = 0;
+}
+// Function to take the status of a group that finished, replying once its whole line is done
+static void server_done(int slot, int status)
+{
+  struct connection *connection = server.connections[slot];
+  if (status != 0)
+    connection->status = status; // The last failure, as run_line reports it
+  if (connection->exited)
+  {
+    connection->midline = false; // Nothing after exit runs
+    connection->input_len = 0;
+  }
+  if (!connection->midline)
+    server_reply(slot, connection->status);
+  if (connection->exited && connection->output_len == 0)
+    server_close(connection);
+}
+// Function to tell whether a group has a builtin that changes the shell next to other commands
+static bool server_mixed(const char *group)
+{
+  char *copy = arena_strdup(&line_arena, group);
+  struct line_ast ast;
+  struct parse_error error;
+  bool mixed = false;
+  int c, st;
+  if (copy != NULL && parse_line(copy, &ast, &error) && ast.group_count == 1 && (ast.groups[0].command_count > 1 || ast.groups[0].commands[0].stage_count > 1))
+  {
+    for (c = 0; c < ast.groups[0].command_count; c++)
+    {
+      for (st = 0; st < ast.groups[0].commands[c].stage_count; st++)
+      {
+        struct stage *stage = &ast.groups[0].commands[c].stages[st];
+        char *word = stage->args_count > 2 && strcmp(stage->args[0], "affinity") == 0 ? stage->args[2] : stage->args[0];
+        const struct builtin_entry *entry = stage->args_count > 0 ? find_builtin(word) : NULL;
+        mixed = mixed || (entry != NULL && entry->state);
+      }
+    }
+  }
+  arena_reset(&line_arena);
+  return mixed;
+}
+/*
+slot: an idle client with a complete line waiting
+Starts the line, or its next ';' group, with the client's stdio in place of the server's.
+Groups that change the client's shell (cd, path...) run right away in the server, the rest
+in a worker whose pidfd is watched, so clients don't wait for each other. Such a builtin
+can't share its group with other commands, '&' or '|', the group would block the server:
+it fails with status 1 instead.
+*/
+static void server_run(int slot)
+{
+  struct connection *connection = server.connections[slot];
+  char *end = memchr(connection->input, '\n', connection->input_len);
+  *end = '\0';
+  if (!connection->midline)
+  {
+    // Only a line that parses is split, one that doesn't is reported whole like anywhere else
+    char *copy = arena_strdup(&line_arena, connection->input);
+    struct line_ast ast;
+    struct parse_error error;
+    connection->midline = copy != NULL && parse_line(copy, &ast, &error) && ast.group_count > 1;
+    connection->status = 0;
+    arena_reset(&line_arena);
+  }
+  char *semicolon = connection->midline ? strchr(connection->input, ';') : NULL; // No quoting, every ';' ends a group
+  char *next = semicolon != NULL ? semicolon : end;
+  *next = '\0';
+  connection->midline = semicolon != NULL;
+  int pidfd = -1;
+  struct wish_result result = {1, false};
+  if (server_mixed(connection->input))
+  {
+    write(connection->stdio[2], error_message, strlen(error_message));
+  }
+  else
+  {
+    int saved[3], i;
+    fflush(stdout);
+    for (i = 0; i < 3; i++)
+    {
+      saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+      dup2(connection->stdio[i], i);
+    }
+    pidfd = wish_start(connection->shell, connection->input, &result);
+    for (i = 0; i < 3; i++)
+    {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+  if (semicolon != NULL)
+    *end = '\n'; // The rest of the line stays queued
+  connection->input_len -= next + 1 - connection->input;
+  memmove(connection->input, next + 1, connection->input_len);
+  struct epoll_event event = {EPOLLIN, {.u64 = SERVER_EVENT(slot, 1)}};
+  if (pidfd >= 0 && epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == 0)
+    connection->worker = pidfd;
+  else if (pidfd >= 0)
+    server_done(slot, wish_wait(pidfd, &result));
+  else
+  {
+    connection->exited = result.exited;
+    server_done(slot, result.status);
+  }
+}
+// Function to take a new client, it is watched from the start and sends its stdio when it likes
+static void server_accept(void)
+{
+  int fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0)
+    return;
+  struct wish *shell = wish_new(); // In the server's directory, with /bin, like a new shell
+  int slot;
+  for (slot = 0; slot < server.connection_count && server.connections[slot]->fd >= 0; slot++)
+    ;
+  if (shell != NULL && slot == server.connection_count)
+  {
+    struct connection **grown = realloc(server.connections, (slot + 1) * sizeof(struct connection *));
+    if (grown != NULL)
+    {
+      server.connections = grown;
+      server.connections[slot] = calloc(1, sizeof(struct connection));
+    }
+    if (grown != NULL && server.connections[slot] != NULL)
+      server.connection_count++;
+  }
+  struct epoll_event event = {EPOLLIN, {.u64 = SERVER_EVENT(slot, 0)}};
+  if (shell == NULL || slot == server.connection_count || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+  {
+    if (shell != NULL)
+      wish_free(shell);
+    close(fd);
+    return;
+  }
+  struct connection *connection = server.connections[slot];
+  memset(connection, 0, sizeof(*connection));
+  connection->fd = fd;
+  connection->stdio[0] = connection->stdio[1] = connection->stdio[2] = -1;
+  connection->shell = shell;
+  connection->worker = -1;
+}
+// Function to take the client's stdin, stdout and stderr from its first message, false if it sent anything else
+static bool server_handshake(struct connection *connection)
+{
+  char byte;
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+  ssize_t got = recvmsg(connection->fd, &msg, MSG_CMSG_CLOEXEC);
+  if (got < 0 && (errno == EINTR || errno == EAGAIN))
+    return true;
+  struct cmsghdr *cmsg = got == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return false;
+  int stdio[3];
+  int i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(stdio, CMSG_DATA(cmsg), count * sizeof(int));
+  if (count != 3)
+  {
+    for (i = 0; i < count; i++)
+      close(stdio[i]); // Fewer than three, MSG_CTRUNC already dropped any more
+    return false;
+  }
+  memcpy(connection->stdio, stdio, sizeof(stdio));
+  return true;
+}
+// Function to read what a client sent, false once it hung up
+static bool server_read(struct connection *connection)
+{
+  if (connection->input_size - connection->input_len < 4096)
+  {
+    size_t size = connection->input_size == 0 ? 8192 : connection->input_size * 2;
+    char *grown = realloc(connection->input, size);
+    if (grown == NULL)
+      return false;
+    connection->input = grown;
+    connection->input_size = size;
+  }
+  ssize_t got = read(connection->fd, connection->input + connection->input_len, connection->input_size - connection->input_len);
+  if (got < 0 && (errno == EINTR || errno == EAGAIN))
+    return true;
+  if (got <= 0)
+    return false;
+  connection->input_len += got;
+  return true;
+}
+/*
+path: where to listen
+Serves command lines until killed: every client gets its own handle, so its own cwd, PATH
+and command cache; lines from one client run in order, clients run side by side. cd, path
+and the other builtins that change the shell must have their ';' group to themselves
+Returns 1 if the socket can't be set up
+*/
+int wish_serve(const char *path)
+{
+  struct sockaddr_un address = {AF_UNIX, ""};
+  if (events.epoll_fd < 0 || strlen(path) >= sizeof(address.sun_path))
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+  unlink(path); // A socket left by an earlier server
+  server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event listener = {EPOLLIN, {.u64 = SERVER_LISTEN}};
+  struct epoll_event children = {EPOLLIN, {.u64 = SERVER_CHILDREN}};
+  if (server.listen_fd < 0 || server.epoll_fd < 0 || bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(server.listen_fd, 128) != 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listener) != 0 ||
+      epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, events.signal_fd, &children) != 0)
+  {
+    write(STDERR_FILENO, error_message, strlen(error_message));
+    return 1;
+  }
+  while (1)
+  {
+    struct epoll_event ready[16];
+    int count = epoll_wait(server.epoll_fd, ready, 16, -1);
+    int i;
+    for (i = 0; i < count; i++)
+    {
+      uint64_t what = ready[i].data.u64;
+      struct connection *connection = what > SERVER_CHILDREN ? server.connections[(what >> 1) - 1] : NULL;
+      if (what == SERVER_LISTEN)
+      {
+        server_accept();
+      }
+      else if (what == SERVER_CHILDREN)
+      {
+        struct signalfd_siginfo info[8];
+        while (read(events.signal_fd, info, sizeof(info)) > 0)
+          ;
+        background_poll(); // '&' jobs of lines run in the server, workers are left to their pidfds
+      }
+      else if ((what & 1) != 0 && connection->worker >= 0)
+      {
+        struct wish_result result;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, connection->worker, NULL);
+        int status = wish_wait(connection->worker, &result);
+        connection->worker = -1;
+        server_done((what >> 1) - 1, status);
+      }
+      else if ((what & 1) == 0 && connection->fd >= 0)
+      {
+        bool open = (ready[i].events & EPOLLOUT) == 0 || server_flush((what >> 1) - 1);
+        if (open && (ready[i].events & EPOLLOUT) != 0 && connection->output_len == 0)
+          server_watch((what >> 1) - 1); // All sent, back to input only
+        if (open && (ready[i].events & ~EPOLLOUT) != 0)
+          open = connection->stdio[0] < 0 ? server_handshake(connection) : server_read(connection);
+        if (!open || (connection->exited && connection->output_len == 0))
+          server_close(connection);
+      }
+    }
+    // The next line, or group of the line, of every idle client
+    for (i = 0; i < server.connection_count; i++)
+    {
+      struct connection *connection = server.connections[i];
+      while (connection->fd >= 0 && connection->worker < 0 && !connection->exited && memchr(connection->input, '\n', connection->input_len) != NULL)
+        server_run(i);
+    }
+  }
+}
+/*
+path: the --server socket
+file: batch script to send, NULL for stdin
+Sends the lines one at a time, with this process's stdin, stdout and stderr for the
+commands to use, so their output lands here; stops after a line that runs exit
+Returns the status of the last line, 1 if the server can't be reached or goes away
+*/
+int wish_client(const char *path, const char *file)
+{
+  struct sockaddr_un address = {AF_UNIX, ""};
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  FILE *input = file == NULL ? stdin : fopen(file, "r");
+  if (strlen(path) >= sizeof(address.sun_path) || fd < 0 || input == NULL)
+    return 1;
+  strcpy(address.sun_path, path);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    return 1;
+  int stdio[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char control[CMSG_SPACE(sizeof(stdio))];
+  struct iovec iov = {"", 1};
+  struct msghdr msg = {NULL, 0, &iov, 1, control, sizeof(control), 0};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(stdio));
+  memcpy(CMSG_DATA(cmsg), stdio, sizeof(stdio));
+  if (sendmsg(fd, &msg, 0) != 1)
+    return 1;
+  signal(SIGPIPE, SIG_IGN); // A server that went away is reported below
+  FILE *replies = fdopen(fd, "r");
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  int status = 0;
+  while ((len = getline(&line, &size, input)) > 0)
+  {
+    if (line[len - 1] != '\n')
+      line[len++] = '\n'; // getline leaves room for the '\0' it wrote there
+    char reply[32], word[8];
+    write_all(fd, line, len);
+    // One reply per line, so the output of the lines doesn't interleave
+    if (fgets(reply, sizeof(reply), replies) == NULL)
+      return 1; // The server went away
+    int fields = sscanf(reply, "%d %7s", &status, word);
+    if (fields < 1)
+      return 1;
+    if (fields == 2 && strcmp(word, "exit") == 0)
+      break; // It hung up after this one
+  }
+  free(line);
+  return status;
+}
@@ -0,0 +1,74 @@
+/*
+Library tests, run by tests/run.sh: a program with children and a memory policy of its own
+runs lines through wish.h, and finds both as it left them. Prints the failures and exits 1
+if any
+
+  cc -O2 -o embed tests/embed.c libwish.c && ./embed
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "../wish.h"
+
+static int failed;
+
+// Function to compare what a case got with what it wants
+static void expect(const char *name, int want, int got)
+{
+  if (want != got)
+  {
+    printf("embed: %s: want %d got %d\n", name, want, got);
+    failed++;
+  }
+}
+
+// Function to start a child of the program itself, already exited with status
+static pid_t own_child(int status)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+    _exit(status);
+  usleep(20000); // Let it be a zombie before the library waits for anything
+  return pid;
+}
+
+int main(void)
+{
+  struct shell_options options = WISH_DEFAULT_OPTIONS;
+  if (!wish_init(&options))
+    return 1;
+  struct wish *shell = wish_new();
+  struct wish_result result;
+  int wstatus;
+  wish_run(shell, "path /bin /usr/bin", &result);
+
+  pid_t pid = own_child(7);
+  expect("run status", 0, wish_run(shell, "cat /dev/null", &result));
+  expect("run leaves the program's child", pid, waitpid(pid, &wstatus, WNOHANG));
+  expect("run child status", 7, WEXITSTATUS(wstatus));
+
+  pid = own_child(8);
+  expect("'&' status", 0, wish_run(shell, "cat /dev/null & cat /dev/null", &result));
+  expect("'&' leaves the program's child", pid, waitpid(pid, &wstatus, WNOHANG));
+
+  pid = own_child(9);
+  int pidfd = wish_start(shell, "cat /dev/null", &result);
+  expect("start", 1, pidfd >= 0);
+  expect("wait status", 0, wish_wait(pidfd, &result));
+  expect("start leaves the program's child", pid, waitpid(pid, &wstatus, WNOHANG));
+  expect("start child status", 9, WEXITSTATUS(wstatus));
+
+  // 'affinity node:N' prefers the node's memory around posix_spawn, then puts ours back
+  unsigned long mask[16] = {1}; // Node 0, which every kernel with NUMA support has
+  int mode;
+  if (syscall(SYS_set_mempolicy, 3, mask, 1025) == 0) // MPOL_INTERLEAVE; ENOSYS without NUMA
+  {
+    wish_run(shell, "affinity node:0 cat /dev/null", &result);
+    expect("memory policy kept", 0, (int)syscall(SYS_get_mempolicy, &mode, mask, 1025, NULL, 0));
+    expect("memory policy mode", 3, mode);
+  }
+
+  wish_free(shell);
+  return failed > 0;
+}
@@ -0,0 +1,126 @@
+/*
+Parser tests, run by tests/run.sh or on their own:
+
+  cc -O2 -o parse tests/parse.c && ./parse
+
+Runs parse_line() from libwish.c over lines that have tripped the lexer or the parser
+before, and compares the AST, written back out in a canonical form, or the syntax error
+with its position, to what is expected. Prints every mismatch and exits 1 if there was any.
+*/
+#include "../libwish.c"
+
+/*
+line: what is parsed
+want: the AST written back as render() does, or "error N: message"
+*/
+struct parse_case
+{
+  const char *line;
+  const char *want;
+};
+static const struct parse_case cases[] = {
+    // '2>' is an operator only at the start of a word
+    {"ls 2>err", "ls 2>err"},
+    {"ls a2>err", "ls a2 >err"},
+    {"ls x 2>&1", "ls x 2>&1"},
+    {"ls 2>err|wc", "ls 2>err | wc"},
+    {"ls a2>&1", "error 6: redirect without a file"},
+    // An operator that ends a word is remembered and comes out as the next token
+    {"ls>out", "ls >out"},
+    {"ls>>out", "ls >>out"},
+    {"ls|wc", "ls | wc"},
+    {"cat<in|wc", "cat <in | wc"},
+    {"ls|>copy|wc", "ls |>copy | wc"},
+    {"ls;pwd", "ls ; pwd"},
+    {"ls>", "error 3: redirect without a file"},
+    // A trailing '&' sends the group to the background, also before ';'
+    {"sleep 1&", "sleep 1 &"},
+    {"sleep 1 &", "sleep 1 &"},
+    {"a & b &", "a & b &"},
+    {"a &; b", "a & ; b"},
+    {"a & b", "a & b"},
+    {"& ls", "error 0: '&' without a command before it"},
+    {"a & & b", "error 4: '&' without a command before it"},
+    // '|>' keeps the pipe, other redirects can follow it
+    {"ls |>f 2>e | wc", "ls |>f 2>e | wc"},
+    {"cat |> f < in | wc", "cat |>f <in | wc"},
+    {"ls 2>&1 |> f | wc", "ls 2>&1 |>f | wc"},
+    {"ls |>f > g", "error 7: more than one '>'"},
+    {"ls > f | wc", "error 7: '>' before the end of a pipeline"},
+    {"ls | wc < in", "error 8: '<' after the start of a pipeline"},
+    {"ls > f x", "error 7: only one file after a redirect"},
+    {"ls |", "error 4: '|' without a command after it"},
+    {"; ls", "error 0: ';' without a command before it"},
+};
+#define CASES (sizeof(cases) / sizeof(cases[0]))
+
+// Function to append to the rendered line
+static void append(char *out, size_t size, const char *text)
+{
+  size_t len = strlen(out);
+  snprintf(out + len, size - len, "%s", text);
+}
+// Function to write an AST back out: one space between words, groups joined by " ; "
+static void render(struct line_ast *ast, char *out, size_t size)
+{
+  static const char *operators[] = {
+      [REDIRECT_OUTPUT] = ">", [REDIRECT_APPEND] = ">>", [REDIRECT_ERROR] = "2>", [REDIRECT_ERROR_TO_OUTPUT] = "2>&1", [REDIRECT_INPUT] = "<", [REDIRECT_TEE] = "|>"};
+  int g, c, st, i;
+  out[0] = '\0';
+  for (g = 0; g < ast->group_count; g++)
+  {
+    struct group *group = &ast->groups[g];
+    if (g > 0)
+      append(out, size, " ; ");
+    for (c = 0; c < group->command_count; c++)
+    {
+      if (c > 0)
+        append(out, size, " & ");
+      for (st = 0; st < group->commands[c].stage_count; st++)
+      {
+        struct stage *stage = &group->commands[c].stages[st];
+        if (st > 0)
+          append(out, size, " | ");
+        for (i = 0; i < stage->args_count; i++)
+        {
+          if (i > 0)
+            append(out, size, " ");
+          append(out, size, stage->args[i]);
+        }
+        for (i = 0; i < stage->redirect_count; i++)
+        {
+          append(out, size, " ");
+          append(out, size, operators[stage->redirects[i].kind]);
+          if (stage->redirects[i].target != NULL)
+            append(out, size, stage->redirects[i].target);
+        }
+      }
+    }
+    if (group->background)
+      append(out, size, " &");
+  }
+}
+
+int main(void)
+{
+  size_t i, failed = 0;
+  for (i = 0; i < CASES; i++)
+  {
+    char line[256], got[512];
+    struct line_ast ast;
+    struct parse_error error;
+    snprintf(line, sizeof(line), "%s", cases[i].line); // Cut up in place
+    if (parse_line(line, &ast, &error))
+      render(&ast, got, sizeof(got));
+    else
+      snprintf(got, sizeof(got), "error %zu: %s", error.position, error.message);
+    if (strcmp(got, cases[i].want) != 0)
+    {
+      printf("%-22s got  %s\n%-22s want %s\n", cases[i].line, got, "", cases[i].want);
+      failed++;
+    }
+    arena_reset(&line_arena);
+  }
+  printf("parse: %zu cases, %zu failed\n", CASES, failed);
+  return failed > 0 ? 1 : 0;
+}
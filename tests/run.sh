@@ -0,0 +1,163 @@
+#!/bin/sh
+# Tests: the parser cases in tests/parse.c, then the shell run over small scripts.
+#
+#   tests/run.sh
+#
+# Builds final.c with libwish.c, tests/parse.c and tests/embed.c with $CC into a scratch directory.
+# Every check prints a line only when it fails; the last line counts them, and the exit
+# status is 1 if any failed. The shell has no quoting, so scripts are written with printf.
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d /tmp/wt.XXXXXX)
+trap 'rm -rf "$work"' EXIT
+$CC $CFLAGS -o "$work/wish" "$root/final.c" "$root/libwish.c" || exit 1
+$CC $CFLAGS -o "$work/parse" "$root/tests/parse.c" || exit 1
+$CC $CFLAGS -o "$work/embed" "$root/tests/embed.c" "$root/libwish.c" || exit 1
+wish=$work/wish
+cd "$work"
+
+checks=0
+failed=0
+# check NAME WANT GOT
+check() {
+  checks=$((checks + 1))
+  if [ "$2" != "$3" ]; then
+    failed=$((failed + 1))
+    printf '%s: want [%s] got [%s]\n' "$1" "$2" "$3"
+  fi
+}
+
+# words: the output's lines joined with single spaces, to compare on one line
+words() {
+  tr '\n' ' ' | sed 's/ $//'
+}
+
+# Parser
+"$work/parse" > parse.out
+check parse 0 $?
+grep -v '^parse:' parse.out
+
+# --memo: the second run of a pure command replays it instead of spawning it
+mkdir memo
+printf 'memoized\n' > memo.in
+printf 'path /bin /usr/bin\npure md5sum\nmd5sum memo.in\n' > memo.sh
+first=$("$wish" --memo="$work/memo" --trace="$work/memo1.csv" memo.sh < /dev/null)
+second=$("$wish" --memo="$work/memo" --trace="$work/memo2.csv" memo.sh < /dev/null)
+check memo-output "$first" "$second"
+check memo-first-spawns 1 "$(grep -c ',B,spawn,' memo1.csv)"
+check memo-second-spawns 0 "$(grep -c ',B,spawn,' memo2.csv)"
+check memo-second-replays 1 "$(grep -c ',i,memo,' memo2.csv)"
+
+# exit ends a batch script in every mode, and the --stats summary still comes out
+printf 'echo a\nexit\necho b\n' > exit.sh
+for mode in plain --read-ahead=2 -j2 compiled; do
+  case $mode in
+    plain) flags= ;;
+    compiled) flags= ; "$wish" --compile exit.sh < /dev/null ;;
+    *) flags=$mode ;;
+  esac
+  "$wish" --stats $flags exit.sh < /dev/null > exit.out 2> exit.err
+  check "exit-$mode-status" 0 $?
+  check "exit-$mode-output" a "$(cat exit.out)"
+  check "exit-$mode-summary" 1 "$(grep -c '^stats: total' exit.err)"
+done
+rm -f exit.sh.wishc
+
+# --read-ahead: the parser thread runs ahead, the script still behaves as it does plainly:
+# cd, a syntax error reported in its turn, output files, and exit stopping the rest
+mkdir ahead
+printf 'path /bin /usr/bin\necho start\ncd ahead\npwd\nls > ls.out\n| broken\ncat ls.out\nexit\necho never\n' > ahead.sh
+"$wish" ahead.sh < /dev/null > ahead.plain 2>&1
+rm ahead/ls.out
+"$wish" --read-ahead=2 ahead.sh < /dev/null > ahead.out 2>&1
+check read-ahead-status 0 $?
+check read-ahead-output "start $work/ahead An error has occurred ls.out" "$(words < ahead.out)"
+check read-ahead-plain "$(words < ahead.plain)" "$(words < ahead.out)"
+
+# --read-ahead: a command added to an earlier PATH directory after the parser thread
+# resolved the line is still found, once the directory check notices (HASH_RECHECK_NS)
+mkdir ra1 ra2
+printf '#!/bin/sh\necho one\n' > ra.one
+printf '#!/bin/sh\necho two\n' > ra2/tool
+chmod +x ra.one ra2/tool
+printf 'path %s/ra1 %s/ra2 /bin /usr/bin\ntool\ncp %s/ra.one %s/ra1/tool\nsleep 1.1\ntool\n' "$work" "$work" "$work" "$work" > ra.sh
+check read-ahead-path "two one" "$("$wish" --read-ahead=4 ra.sh < /dev/null | words)"
+
+# 'affinity node:N' under --launch=prefork: the zygote prefers the node's memory too, as a
+# forked command does (skipped without NUMA support, where no command can)
+printf 'path /bin /usr/bin\n' > numa.sh
+for i in 1 2 3 4 5 6; do
+  printf 'affinity node:0 grep -c prefer /proc/self/numa_maps\n' >> numa.sh
+done
+if [ "$("$wish" --launch=fork numa.sh < /dev/null 2>/dev/null | grep -c '^[1-9]')" -eq 6 ]; then
+  check numa-prefork 6 "$("$wish" --launch=prefork numa.sh < /dev/null | grep -c '^[1-9]')"
+fi
+
+# --compile: the compiled form runs without parsing, only while it matches the script. An
+# edit that keeps the size and mtime is caught by the hash; a damaged file, two lines at one
+# offset here, is parsed instead. 48 is where struct compiled_header keeps the line table
+printf 'echo one\necho two\n' > compile.sh
+"$wish" --compile compile.sh < /dev/null
+check compile-run "one two" "$("$wish" --trace="$work/compile1.csv" compile.sh < /dev/null | words)"
+check compile-parsed 0 "$(grep -c ',B,parse,' compile1.csv)"
+touch -r compile.sh compile.ref
+printf 'echo uno\necho two\n' > compile.sh
+touch -r compile.ref compile.sh
+check compile-edited "uno two" "$("$wish" compile.sh < /dev/null | words)"
+"$wish" --compile compile.sh < /dev/null
+lines=$(od -An -t u8 -j 48 -N 8 compile.sh.wishc | tr -d ' ')
+dd if=compile.sh.wishc of=compile.sh.wishc bs=1 skip="$lines" count=8 seek=$((lines + 8)) conv=notrunc 2> /dev/null
+check compile-aliased "uno two" "$("$wish" --trace="$work/compile2.csv" compile.sh < /dev/null | words)"
+check compile-aliased-parsed 2 "$(grep -c ',B,parse,' compile2.csv)"
+
+# --capture: the first command of a '&' group finishes last; ordered keeps the group's
+# order, prefix tags each line with its command as it finishes. --max-jobs=2 so both run
+# at once even on one CPU
+printf '#!/bin/sh\nsleep 0.3\necho slow\n' > slow
+chmod +x slow
+printf 'path %s /bin /usr/bin\nslow & echo fast\n' "$work" > capture.sh
+check capture-off "fast slow" "$("$wish" --max-jobs=2 capture.sh < /dev/null | words)"
+check capture-ordered "slow fast" "$("$wish" --max-jobs=2 --capture=ordered capture.sh < /dev/null | words)"
+check capture-prefix "[2] fast [1] slow" "$("$wish" --max-jobs=2 --capture=prefix capture.sh < /dev/null | words)"
+
+# -j: lines run side by side, a line using a '>' file another line still writes waits for
+# it, cd is a fence the later lines see, and a failed line is counted in the status
+mkdir jobs
+printf 'path %s /bin /usr/bin\nslow > jobs.out\necho after >> jobs.out\ncd jobs\npwd\nslow\nslow\nslow\nfalse\n' "$work" > jobs.sh
+started=$(date +%s%N)
+"$wish" -j4 jobs.sh < /dev/null > jobs.txt 2> jobs.err
+check jobs-status 1 $?
+elapsed=$((($(date +%s%N) - started) / 1000000))
+check jobs-output "$work/jobs slow slow slow" "$(words < jobs.txt)"
+check jobs-summary "batch: 9 lines, 8 succeeded, 1 failed" "$(cat jobs.err)"
+check jobs-waited "slow after" "$(words < jobs.out)"
+check jobs-concurrent yes "$([ "$elapsed" -lt 1000 ] && echo yes || echo "no, ${elapsed}ms")" # 1.2 s one line at a time
+
+# --server / --client: lines run in the server with the client's stdout, the client exits
+# with its last line's status, exit ends only that client, and each client has its own cwd
+"$wish" --server="$work/sock" < /dev/null > server.log 2>&1 &
+server=$!
+tries=0
+while [ ! -S sock ] && [ $tries -lt 50 ]; do
+  sleep 0.1
+  tries=$((tries + 1))
+done
+printf 'path /bin /usr/bin\necho hello\nfalse\n' | "$wish" --client="$work/sock" > client1.out
+check server-status 1 $?
+check server-output hello "$(words < client1.out)"
+printf 'cd jobs\npwd\nexit\necho never\n' | "$wish" --client="$work/sock" > client2.out
+check server-exit 0 $?
+check server-exit-output "$work/jobs" "$(words < client2.out)"
+check server-cwd "$work" "$(printf 'pwd\n' | "$wish" --client="$work/sock")"
+kill "$server"
+wait "$server" 2> /dev/null
+
+# The library only reaps what it started, the program's own children stay its own
+"$work/embed" > embed.out
+check embed 0 $?
+cat embed.out
+
+echo "tests: $checks checks, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,132 @@
+/*
+libwish: the parser, builtins and launcher of the wish shell, to run command lines from
+inside another program instead of exec'ing a shell for them
+
+There is no build manifest, build it with:
+  cc -O2 -o wish final.c libwish.c                                          the shell
+  cc -O2 -c -fvisibility=hidden libwish.c && ar rcs libwish.a libwish.o     static library
+  cc -O2 -shared -fPIC -fvisibility=hidden -o libwish.so libwish.c          shared library
+and link programs using it with -lwish (plus -lpthread with glibc older than 2.34).
+
+Like the shell it comes from, the library keeps process-wide state: call wish_init() first
+and call it from one thread. It blocks SIGCHLD and SIGPIPE and only ever waits for the
+processes it started, so your own children stay yours to reap; don't reap them with
+waitpid(-1) yourself while a line runs. Commands use the process's stdin, stdout and stderr.
+*/
+#ifndef WISH_H
+#define WISH_H
+
+#include <stdbool.h>
+
+#define WISH_API __attribute__((visibility("default")))
+
+/*
+LAUNCH_SPAWN: posix_spawn, glibc uses clone(CLONE_VM|CLONE_VFORK) so no page tables are copied
+LAUNCH_FORK: the classic fork + execv, kept to benchmark against
+LAUNCH_PREFORK: hand the command to a zygote forked ahead of time, which only has to dup2
+and execv; posix_spawn when none is ready
+*/
+enum launch_mode
+{
+  LAUNCH_SPAWN,
+  LAUNCH_FORK,
+  LAUNCH_PREFORK
+};
+/*
+CAPTURE_OFF: commands of a '&' group write wherever their stdout and stderr point
+CAPTURE_ORDERED: the group's output comes out command by command, in the order written
+CAPTURE_PREFIX: lines come out as they are finished, each one prefixed with "[N] "
+*/
+enum capture_mode
+{
+  CAPTURE_OFF,
+  CAPTURE_ORDERED,
+  CAPTURE_PREFIX
+};
+/*
+IO_EPOLL: captured output is read() when epoll says it is there, and write()n out
+IO_URING: io_uring reads it into registered buffers and writes the ordered head straight
+back out of them, with one io_uring_enter per wakeup; epoll is used if the kernel says no
+*/
+enum io_backend
+{
+  IO_EPOLL,
+  IO_URING
+};
+/*
+AFFINITY_OFF: the kernel places every command
+AFFINITY_SPREAD: one CPU per process of a '&' group, one core of every package in turn, so
+they share as few caches and as little memory bandwidth as possible
+AFFINITY_COMPACT: one CPU per process, filling a core's threads, then a package's cores,
+so they share caches
+AFFINITY_NUMA: every command of a '&' group on a NUMA node in turn, its CPUs and its memory,
+with every --launch mode
+*/
+enum affinity_policy
+{
+  AFFINITY_OFF,
+  AFFINITY_SPREAD,
+  AFFINITY_COMPACT,
+  AFFINITY_NUMA
+};
+/*
+launch: how external commands are started (--launch=spawn|fork|prefork)
+pipe_size: F_SETPIPE_SZ for every pipeline pipe, 0 keeps the kernel default (--pipe-size=BYTES)
+max_jobs: '&' commands allowed to run at once, 0 for the online CPU count (--max-jobs=N)
+batch_jobs: batch lines run concurrently, 1 keeps the file strictly sequential (-j N)
+check_only: parse the batch script and report syntax errors with their position, run nothing (-n)
+compile: write the batch script's parsed form to SCRIPT.wishc, which later runs load instead (--compile)
+read_ahead: batch lines a parser thread keeps parsed and resolved ahead of the one running, 0 for none; ignored with LAUNCH_FORK (--read-ahead=N)
+stats: per-line and end of batch resource summaries on stderr (--stats)
+external: run echo, printf, test and the other utility builtins as programs (--external)
+capture: what happens to the output of '&' groups (--capture=ordered|prefix)
+io: how captured output is moved (--io=epoll|uring)
+affinity: where the processes of a '&' group run (--affinity=spread|compact|numa)
+trace: file, or fd:N, to write a trace of every line to, NULL for $WISH_TRACE (--trace=FILE)
+memo: directory keeping the results of pure commands, NULL for none (--memo=DIR)
+server: Unix socket to serve command lines on instead of reading any, NULL for none (--server=PATH)
+client: Unix socket of a server to send the batch script or stdin to, NULL for none (--client=PATH)
+*/
+struct shell_options
+{
+  enum launch_mode launch;
+  int pipe_size;
+  int max_jobs;
+  int batch_jobs;
+  bool check_only;
+  bool compile;
+  int read_ahead;
+  bool stats;
+  bool external;
+  enum capture_mode capture;
+  enum io_backend io;
+  enum affinity_policy affinity;
+  const char *trace;
+  const char *memo;
+  const char *server;
+  const char *client;
+};
+#define WISH_DEFAULT_OPTIONS {LAUNCH_SPAWN, 0, 0, 1, false, false, 0, false, false, CAPTURE_OFF, IO_EPOLL, AFFINITY_OFF, NULL, NULL, NULL, NULL}
+/*
+status: exit status of the line, 0 if every command succeeded
+exited: the line called exit, which never ends the calling program
+*/
+struct wish_result
+{
+  int status;
+  bool exited;
+};
+struct wish; // A shell's own state: PATH, working directory and command cache
+
+WISH_API bool wish_init(const struct shell_options *options);
+WISH_API struct wish *wish_new(void);
+WISH_API void wish_free(struct wish *shell);
+WISH_API int wish_run(struct wish *shell, const char *line, struct wish_result *result);
+WISH_API int wish_start(struct wish *shell, const char *line, struct wish_result *result);
+WISH_API int wish_wait(int pidfd, struct wish_result *result);
+WISH_API int wish_batch(struct wish *shell, const char *file);
+WISH_API int wish_interactive(struct wish *shell);
+WISH_API int wish_serve(const char *path);
+WISH_API int wish_client(const char *path, const char *file);
+
+#endif